@@ -0,0 +1,327 @@
+/*
+ * SQL aggregate functions over the roll up state
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rollup.h"
+#include "kernel.h"
+
+/*
+ * Front of a state blob. The sketch, when there is one, follows as
+ * tdigestSerialize wrote it
+ */
+typedef struct stateHeader {
+    uint32_t version;
+    uint32_t flags;
+    int64_t count;
+    double sum;
+    double min;
+    double max;
+    double m2;
+} stateHeader;
+
+#define STATE_VERSION   1
+#define STATE_SKETCH    1       // a sketch of every sample follows
+
+/*
+ * Accumulator of rollup_agg()
+ */
+typedef struct aggState {
+    rollupBucket b;         // the samples folded so far
+    valueBuffer values;     // the samples still to fold, ROLLUP_AGG_FOLD at most
+    int noSketch;
+} aggState;
+
+/**
+ * \brief Pack a bucket into a state blob
+ *        A sketch short of some samples, from a child written before
+ *        sketches, is left out as the stores do
+ * @param b The bucket
+ * @param blob At least ROLLUP_STATE_MAX bytes
+ * @return The blob size
+ */
+int bucketSerialize (const rollupBucket *b, unsigned char *blob) {
+    stateHeader h;
+    int bytes = sizeof (h);
+    memset(&h, 0, sizeof (h));
+    h.version = STATE_VERSION;
+    h.count = b->vcount;
+    h.sum = b->vsum;
+    h.min = b->vmin;
+    h.max = b->vmax;
+    h.m2 = b->vm2;
+    if (b->vcount > 0 && b->sketch.weight == b->vcount) {
+        h.flags |= STATE_SKETCH;
+        bytes += tdigestSerialize(&b->sketch, blob + sizeof (h));
+    }
+    memcpy(blob, &h, sizeof (h));
+    return bytes;
+}
+
+/**
+ * \brief Unpack a state blob into a bucket
+ * @param b The bucket, all zero if the blob is not a state
+ * @param blob The blob
+ * @param bytes Its size
+ * @return 0 if all good, -1 if the blob is not a state
+ */
+int bucketDeserialize (rollupBucket *b, const void *blob, int bytes) {
+    stateHeader h;
+    memset(b, 0, sizeof (*b));
+    if (blob == NULL || bytes < (int)sizeof (h)) {
+        return -1;
+    }
+    memcpy(&h, blob, sizeof (h));
+    if (h.version != STATE_VERSION || h.count < 0 ||
+        ((h.flags & STATE_SKETCH) == 0 && bytes != (int)sizeof (h)) ||
+        ((h.flags & STATE_SKETCH) != 0 &&
+         tdigestDeserialize(&b->sketch, (const unsigned char *)blob + sizeof (h), bytes - sizeof (h)) != 0)) {
+        memset(b, 0, sizeof (*b));
+        return -1;
+    }
+    b->vcount = h.count;
+    b->vsum = h.sum;
+    b->vmin = h.min;
+    b->vmax = h.max;
+    b->vm2 = h.m2;
+    if (b->vcount > 0) {
+        b->vavg = b->vsum / b->vcount;
+    }
+    return 0;
+}
+
+/**
+ * \brief Hand a bucket back as the state blob of a function
+ *        NULL when it holds no sample, as SQL aggregates over nothing are
+ * @param context The function context
+ * @param b The bucket
+ */
+static void resultBucket (sqlite3_context *context, const rollupBucket *b) {
+    unsigned char blob[ROLLUP_STATE_MAX];
+    if (b->vcount == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    sqlite3_result_blob(context, blob, bucketSerialize(b, blob), SQLITE_TRANSIENT);
+}
+
+/**
+ * \brief Fold the gathered samples of rollup_agg() into its bucket
+ * @param a The accumulator, its buffer is emptied
+ */
+static void aggFold (aggState *a) {
+    if (a->noSketch) {
+        rollupBucket b;
+        kernelAgg k;
+        memset(&b, 0, sizeof (b));
+        kernelAggregate(a->values.values, a->values.count, &k);
+        b.vcount = k.count;
+        b.vsum = k.sum;
+        b.vmin = k.min;
+        b.vmax = k.max;
+        b.vm2 = k.m2;
+        foldBucket(&a->b, &b);
+    } else {
+        foldValues(&a->b, a->values.values, a->values.count);
+    }
+    a->values.count = 0;
+}
+
+/**
+ * \brief Step of rollup_agg(value [, sketch])
+ *        The samples are gathered and folded through the vector kernel
+ *        every ROLLUP_AGG_FOLD of them, so the memory stays bounded and a
+ *        bucket the engine would fold in one call comes out the same as
+ *        when the engine folds it. NULL is a missing sample
+ * @param context The function context
+ * @param argc 1, or 2 with a sketch flag, 0 to leave the sketch out
+ * @param argv The sample and the flag
+ */
+static void aggStep (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    aggState *a = sqlite3_aggregate_context(context, sizeof (*a));
+    if (a == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (argc > 1) {
+        a->noSketch = !sqlite3_value_int(argv[1]);
+    }
+    valuePush(&a->values, sqlite3_value_type(argv[0]) == SQLITE_NULL ? NAN : sqlite3_value_double(argv[0]));
+    if (a->values.rc != SQLITE_OK) {
+        sqlite3_result_error_nomem(context);
+    } else if (a->values.count == ROLLUP_AGG_FOLD) {
+        aggFold(a);
+    }
+}
+
+static void aggFinal (sqlite3_context *context) {
+    aggState *a = sqlite3_aggregate_context(context, 0);
+    if (a == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    aggFold(a);
+    free(a->values.values);
+    resultBucket(context, &a->b);
+}
+
+/**
+ * \brief Step of rollup_merge(state) and rollup_merge(vsum, vmax, vmin,
+ *        vcount, vm2, sketch)
+ *        The first folds state blobs, the second the columns of roll up
+ *        rows, so a level reads its children with one aggregate per row
+ * @param context The function context
+ * @param argc 1 or 6
+ * @param argv The state, or the columns
+ */
+static void mergeStep (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    rollupBucket *m = sqlite3_aggregate_context(context, sizeof (*m));
+    rollupBucket b;
+    if (m == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (argc == 1) {
+        if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+            return;
+        }
+        if (bucketDeserialize(&b, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0])) != 0) {
+            sqlite3_result_error(context, "rollup_merge: not a roll up state", -1);
+            return;
+        }
+    } else {
+        // as the SQLite store reads a row, NULL M2 from before it existed
+        memset(&b, 0, sizeof (b));
+        b.vsum =   sqlite3_value_double (argv[0]);
+        b.vmax =   sqlite3_value_double (argv[1]);
+        b.vmin =   sqlite3_value_double (argv[2]);
+        b.vcount = sqlite3_value_int64  (argv[3]);
+        b.vm2 = sqlite3_value_type(argv[4]) == SQLITE_NULL ? NAN : sqlite3_value_double(argv[4]);
+        tdigestDeserialize(&b.sketch, sqlite3_value_blob(argv[5]), sqlite3_value_bytes(argv[5]));
+    }
+    foldBucket(m, &b);
+}
+
+static void mergeFinal (sqlite3_context *context) {
+    rollupBucket *m = sqlite3_aggregate_context(context, 0);
+    if (m == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    resultBucket(context, m);
+}
+
+/**
+ * \brief SQL function rollup_stat(state, name)
+ *        name is count, sum, avg, min, max, var or stddev, the last two of
+ *        a sample, or pNN for a quantile such as p50 or p99.9. NULL when
+ *        the state cannot answer, as a quantile without a sketch
+ * @param context The function context
+ * @param argc 2
+ * @param argv The state blob and the name
+ */
+static void statFunc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    rollupBucket b;
+    const char *name = (const char *)sqlite3_value_text(argv[1]);
+    if (name == NULL ||
+        bucketDeserialize(&b, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0])) != 0 ||
+        b.vcount == 0) {
+        sqlite3_result_null(context);
+    } else if (strcmp(name, "count") == 0) {
+        sqlite3_result_int64(context, b.vcount);
+    } else if (strcmp(name, "sum") == 0) {
+        sqlite3_result_double(context, b.vsum);
+    } else if (strcmp(name, "avg") == 0) {
+        sqlite3_result_double(context, b.vavg);
+    } else if (strcmp(name, "min") == 0) {
+        sqlite3_result_double(context, b.vmin);
+    } else if (strcmp(name, "max") == 0) {
+        sqlite3_result_double(context, b.vmax);
+    } else if (strcmp(name, "var") == 0 || strcmp(name, "stddev") == 0) {
+        double var = b.vcount > 1 ? b.vm2 / (b.vcount - 1) : 0;
+        sqlite3_result_double(context, name[0] == 'v' ? var : sqrt(var));
+    } else if (name[0] == 'p' && b.sketch.weight == b.vcount) {
+        char *end;
+        double q = strtod(name + 1, &end) / 100;
+        if (end == name + 1 || *end != '\0' || q < 0 || q > 1) {
+            sqlite3_result_error(context, "rollup_stat: bad quantile", -1);
+        } else {
+            sqlite3_result_double(context, tdigestQuantile(&b.sketch, q));
+        }
+    } else if (name[0] != 'p') {
+        sqlite3_result_error(context, "rollup_stat: unknown statistic", -1);
+    } else {
+        sqlite3_result_null(context);
+    }
+}
+
+/**
+ * \brief SQL function rollup_quantile(sketch, q)
+ *        NULL when the row has no sketch
+ * @param context The function context
+ * @param argc 2
+ * @param argv The sketch blob and the quantile, 0 to 1
+ */
+static void quantileFunc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    tdigest d;
+    if (tdigestDeserialize(&d, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0])) != 0 ||
+        d.count == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    sqlite3_result_double(context, tdigestQuantile(&d, sqlite3_value_double(argv[1])));
+}
+
+/**
+ * \brief Register the roll up SQL functions on a connection
+ * @param db The database connection
+ * @return 0 if all good
+ */
+int aggregateRegister (sqlite3 *db) {
+    const int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int rc = sqlite3_create_function_v2(db, "rollup_quantile", 2, flags, NULL, quantileFunc, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_agg", 1, flags, NULL, NULL, aggStep, aggFinal, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_agg", 2, flags, NULL, NULL, aggStep, aggFinal, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_merge", 1, flags, NULL, NULL, mergeStep, mergeFinal, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_merge", 6, flags, NULL, NULL, mergeStep, mergeFinal, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_stat", 2, flags, NULL, statFunc, NULL, NULL, NULL);
+    }
+    return rc;
+}
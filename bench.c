@@ -0,0 +1,214 @@
+/*
+ * Benchmark harness
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+#define BENCH_BATCH     65536
+
+typedef enum {
+    STAGE_INGEST = 0,
+    STAGE_ROLLUP,           // one per level in use, finest first
+    STAGE_INGEST_LATE = STAGE_ROLLUP + ROLLUP_LEVELS,
+    STAGE_ROLLUP_LATE,
+    STAGE_COUNT
+} enBenchStage;
+
+/**
+ * \brief Name of a stage in the report
+ * @param stage The stage. See enBenchStage
+ * @param name The output buffer
+ * @return The name, NULL for the slot of a level not in use
+ */
+static const char *stageName (int stage, char *name) {
+    switch (stage) {
+        case STAGE_INGEST:
+            return "ingest";
+        case STAGE_INGEST_LATE:
+            return "ingest-late";
+        case STAGE_ROLLUP_LATE:
+            return "rollup-late";
+    }
+    if (stage - STAGE_ROLLUP >= levelCount()) {
+        return NULL;
+    }
+    sprintf (name, "rollup-%s", levelName(levelAt(stage - STAGE_ROLLUP)));
+    return name;
+}
+
+/**
+ * \brief Decide whether a sample is delivered late
+ *        The choice is a hash of the sample, so every run and every version
+ *        sees the same workload
+ * @param tagId The tag ID
+ * @param ts The sample time stamp
+ * @param ratio The share of late samples
+ * @return Non zero if late
+ */
+static int sampleLate (int64_t tagId, int64_t ts, double ratio) {
+    uint64_t h = (uint64_t)tagId * 0x9E3779B97F4A7C15ULL ^ (uint64_t)ts;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (h >> 11) * (1.0 / 9007199254740992.0) < ratio;
+}
+
+/**
+ * \brief Feed the on time or the late samples of the workload
+ * @param ctx The connection context
+ * @param cfg The workload
+ * @param late Which samples
+ * @param count The number of samples fed
+ * @return 0 if all good
+ */
+static int benchIngest (rollupCtx *ctx, const benchConfig *cfg, int late, int64_t *count) {
+    int rc = SQLITE_OK;
+    rollupSample *batch = malloc(BENCH_BATCH * sizeof (rollupSample));
+    if (batch == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int64_t start = iso8602ts(cfg->startDate);
+    int64_t end = iso8602ts(cfg->endDate);
+    int64_t ts;
+    int n = 0;
+    int tag;
+    *count = 0;
+    for (ts = start; ts <= end && rc == SQLITE_OK; ts += cfg->interval) {
+        for (tag = 1; tag <= cfg->tags && rc == SQLITE_OK; tag++) {
+            if (sampleLate(tag, ts, cfg->lateRatio) != late) {
+                continue;
+            }
+            batch[n].tagId = tag;
+            batch[n].ts = ts;
+            batch[n].value = (double)((ts / cfg->interval + tag) % 100);
+            if (++n == BENCH_BATCH) {
+                rc = ingestSamples(ctx, batch, n);
+                *count += n;
+                n = 0;
+            }
+        }
+    }
+    if (rc == SQLITE_OK && n > 0) {
+        rc = ingestSamples(ctx, batch, n);
+        *count += n;
+    }
+    free(batch);
+    return rc;
+}
+
+static int compareNanos (const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * \brief Run the workload cfg->repeats times and report every stage
+ *        Each run starts from an empty database. Stages are timed with the
+ *        monotonic clock and reported as one JSON object per line, with the
+ *        median and the 95th percentile (nearest rank) over the runs
+ * @param ctx The connection context
+ * @param cfg The workload
+ * @return 0 if all good
+ */
+int benchRun (rollupCtx *ctx, const benchConfig *cfg) {
+    int rc = SQLITE_OK;
+    int repeats = cfg->repeats > 0 ? cfg->repeats : 1;
+    int64_t *nanos = calloc((size_t)STAGE_COUNT * repeats, sizeof (int64_t));
+    int64_t items[STAGE_COUNT];
+    int run, stage, i;
+    char name[32];
+    if (nanos == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(items, 0, sizeof (items));
+    for (run = 0; run < repeats && rc == SQLITE_OK; run++) {
+        int64_t *ns = &nanos[run * STAGE_COUNT];
+        ctx->store->methods->xReset(ctx->store);
+        int64_t t = monotonicNanos();
+        rc = benchIngest(ctx, cfg, 0, &items[STAGE_INGEST]);
+        ns[STAGE_INGEST] = monotonicNanos() - t;
+        for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+            int64_t jobs = ctx->jobs;
+            t = monotonicNanos();
+            rc = rollup(ctx, levelAt(i));
+            ns[STAGE_ROLLUP + i] = monotonicNanos() - t;
+            items[STAGE_ROLLUP + i] = ctx->jobs - jobs;
+        }
+        if (rc == SQLITE_OK) {
+            t = monotonicNanos();
+            rc = benchIngest(ctx, cfg, 1, &items[STAGE_INGEST_LATE]);
+            ns[STAGE_INGEST_LATE] = monotonicNanos() - t;
+        }
+        int64_t jobs = ctx->jobs;
+        t = monotonicNanos();
+        for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+            rc = rollup(ctx, levelAt(i));
+        }
+        ns[STAGE_ROLLUP_LATE] = monotonicNanos() - t;
+        items[STAGE_ROLLUP_LATE] = ctx->jobs - jobs;
+    }
+    if (rc != SQLITE_OK) {
+        printf ("Benchmark failed on run %d with error %d\n", run, rc);
+        free(nanos);
+        return rc;
+    }
+    int64_t *sorted = malloc(repeats * sizeof (int64_t));
+    for (stage = 0; stage < STAGE_COUNT && sorted != NULL; stage++) {
+        if (stageName(stage, name) == NULL) {
+            continue;
+        }
+        for (run = 0; run < repeats; run++) {
+            sorted[run] = nanos[run * STAGE_COUNT + stage];
+        }
+        qsort(sorted, repeats, sizeof (int64_t), compareNanos);
+        int64_t median = sorted[(repeats - 1) / 2];
+        int64_t p95 = sorted[(95 * repeats + 99) / 100 - 1];
+        printf ("{\"stage\":\"%s\",\"items\":%" PRId64 ",\"runs\":%d,"
+                "\"median_ns\":%" PRId64 ",\"p95_ns\":%" PRId64 ","
+                "\"median_per_s\":%.1f,\"p95_per_s\":%.1f,"
+                "\"tags\":%d,\"interval\":%d,\"start\":\"%s\",\"end\":\"%s\",\"late_ratio\":%g,"
+                "\"threads\":%d,\"batch_jobs\":%d,\"backend\":\"%s\",\"sqlite\":\"%s\"}\n",
+                stageName(stage, name), items[stage], repeats, median, p95,
+                median > 0 ? items[stage] * 1e9 / median : 0.0,
+                p95 > 0 ? items[stage] * 1e9 / p95 : 0.0,
+                cfg->tags, cfg->interval, cfg->startDate, cfg->endDate, cfg->lateRatio,
+                ctx->threads, ctx->batchJobs, ctx->store->methods->name, sqlite3_libversion());
+    }
+    free(sorted);
+    free(nanos);
+    return rc;
+}
@@ -0,0 +1,480 @@
+/*
+ * Compressed block store for raw samples
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+
+/*
+ * Bit level writer into a caller buffer of BLOCK_BYTES_MAX bytes
+ */
+typedef struct blockEncoder {
+    uint8_t *data;
+    size_t pos;
+    int64_t ts;
+    int64_t delta;
+    uint64_t value;
+    int lead;
+    int trail;
+} blockEncoder;
+
+static void putBits (blockEncoder *e, uint64_t bits, int count) {
+    while (count > 0) {
+        int room = 8 - (int)(e->pos & 7);
+        int n = count < room ? count : room;
+        uint8_t chunk = (uint8_t)((bits >> (count - n)) & ((1u << n) - 1));
+        if ((e->pos & 7) == 0) {
+            e->data[e->pos >> 3] = 0;
+        }
+        e->data[e->pos >> 3] |= chunk << (room - n);
+        e->pos += n;
+        count -= n;
+    }
+}
+
+/**
+ * \brief Read bits from a block, never past its end
+ * @param d The decoder. A read that would go past the end stops the block
+ * @param count How many bits, 64 at most
+ * @return The bits, 0 once the block is stopped
+ */
+static uint64_t getBits (blockDecoder *d, int count) {
+    uint64_t bits = 0;
+    if (d->remaining <= 0 || count > 64 || d->pos + count > d->bits) {
+        d->remaining = 0;       // truncated block
+        return 0;
+    }
+    while (count > 0) {
+        int room = 8 - (int)(d->pos & 7);
+        int n = count < room ? count : room;
+        uint8_t byte = d->data[d->pos >> 3];
+        bits = (bits << n) | ((byte >> (room - n)) & ((1u << n) - 1));
+        d->pos += n;
+        count -= n;
+    }
+    return bits;
+}
+
+static uint64_t doubleBits (double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof (u));
+    return u;
+}
+
+static double bitsDouble (uint64_t u) {
+    double v;
+    memcpy(&v, &u, sizeof (v));
+    return v;
+}
+
+/**
+ * \brief Append one sample to a block
+ *        The first one goes in raw, 64 bits of time stamp and 64 of value
+ * @param e The encoder
+ * @param first Non zero for the first sample of the block
+ * @param ts The time stamp
+ * @param value The value
+ */
+static void encodeSample (blockEncoder *e, int first, int64_t ts, double value) {
+    uint64_t v = doubleBits(value);
+    if (first) {
+        putBits(e, (uint64_t)ts, 64);
+        putBits(e, v, 64);
+        e->ts = ts;
+        e->delta = 0;
+        e->value = v;
+        e->lead = -1;
+        return;
+    }
+    int64_t delta = ts - e->ts;
+    int64_t dod = delta - e->delta;
+    if (dod == 0) {
+        putBits(e, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        putBits(e, 2, 2);
+        putBits(e, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+        putBits(e, 6, 3);
+        putBits(e, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        putBits(e, 14, 4);
+        putBits(e, (uint64_t)(dod + 2047), 12);
+    } else {
+        putBits(e, 15, 4);
+        putBits(e, (uint64_t)dod, 64);
+    }
+    e->ts = ts;
+    e->delta = delta;
+    uint64_t x = v ^ e->value;
+    e->value = v;
+    if (x == 0) {
+        putBits(e, 0, 1);
+        return;
+    }
+    int lead = __builtin_clzll(x);
+    int trail = __builtin_ctzll(x);
+    if (lead > 31) {
+        lead = 31;
+    }
+    if (e->lead >= 0 && lead >= e->lead && trail >= e->trail) {
+        // fits in the meaningful bits of the previous value
+        putBits(e, 2, 2);
+        putBits(e, x >> e->trail, 64 - e->lead - e->trail);
+    } else {
+        int meaningful = 64 - lead - trail;
+        putBits(e, 3, 2);
+        putBits(e, (uint64_t)lead, 5);
+        putBits(e, (uint64_t)(meaningful - 1), 6);
+        putBits(e, x >> trail, meaningful);
+        e->lead = lead;
+        e->trail = trail;
+    }
+}
+
+/**
+ * \brief Encode samples of one tag, in time order
+ * @param samples The samples
+ * @param count How many, at most BLOCK_SAMPLES
+ * @param data At least BLOCK_BYTES_MAX bytes
+ * @return The block size in bytes
+ */
+static int blockEncode (const rollupSample *samples, int count, uint8_t *data) {
+    blockEncoder e;
+    int i;
+    memset(&e, 0, sizeof (e));
+    e.data = data;
+    for (i = 0; i < count; i++) {
+        encodeSample(&e, i == 0, samples[i].ts, samples[i].value);
+    }
+    return (int)((e.pos + 7) >> 3);
+}
+
+/**
+ * \brief Start reading a block
+ * @param d The decoder
+ * @param data The block
+ * @param bytes The block size
+ * @param count How many samples it holds
+ */
+static void blockDecodeBegin (blockDecoder *d, const void *data, int bytes, int count) {
+    memset(d, 0, sizeof (*d));
+    d->data = data;
+    d->bits = (size_t)bytes * 8;
+    d->remaining = data != NULL && bytes >= 16 ? count : 0;
+    d->lead = -1;
+}
+
+/**
+ * \brief Read the next sample of a block
+ * @param d The decoder
+ * @param ts The time stamp
+ * @param value The value
+ * @return 1 if there was one, 0 at the end of the block
+ */
+static int blockDecodeNext (blockDecoder *d, int64_t *ts, double *value) {
+    if (d->remaining <= 0) {
+        return 0;
+    }
+    if (d->pos == 0) {
+        d->ts = (int64_t)getBits(d, 64);
+        d->value = getBits(d, 64);
+    } else {
+        int64_t dod;
+        if (getBits(d, 1) == 0) {
+            dod = 0;
+        } else if (getBits(d, 1) == 0) {
+            dod = (int64_t)getBits(d, 7) - 63;
+        } else if (getBits(d, 1) == 0) {
+            dod = (int64_t)getBits(d, 9) - 255;
+        } else if (getBits(d, 1) == 0) {
+            dod = (int64_t)getBits(d, 12) - 2047;
+        } else {
+            dod = (int64_t)getBits(d, 64);
+        }
+        // wraps as the encoder did, a corrupt block must not overflow
+        d->delta = (int64_t)((uint64_t)d->delta + (uint64_t)dod);
+        d->ts = (int64_t)((uint64_t)d->ts + (uint64_t)d->delta);
+        if (getBits(d, 1) == 1) {
+            if (getBits(d, 1) == 1) {
+                d->lead = (int)getBits(d, 5);
+                int meaningful = (int)getBits(d, 6) + 1;
+                d->trail = 64 - d->lead - meaningful;
+            }
+            if (d->lead < 0 || d->trail < 0) {
+                d->remaining = 0;   // a corrupt window
+            } else {
+                d->value ^= getBits(d, 64 - d->lead - d->trail) << d->trail;
+            }
+        }
+    }
+    if (d->remaining <= 0) {
+        return 0;               // stopped by getBits
+    }
+    d->remaining--;
+    *ts = d->ts;
+    *value = bitsDouble(d->value);
+    return 1;
+}
+
+/**
+ * \brief Write samples as new blocks of at most BLOCK_SAMPLES each
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param samples The samples, in time order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+static int blockWrite (rollupCtx *ctx, int64_t tagId, const rollupSample *samples, int count) {
+    int rc = SQLITE_OK;
+    uint8_t data[BLOCK_BYTES_MAX];
+    int i;
+    for (i = 0; i < count && rc == SQLITE_OK; i += BLOCK_SAMPLES) {
+        int n = count - i < BLOCK_SAMPLES ? count - i : BLOCK_SAMPLES;
+        int bytes = blockEncode(&samples[i], n, data);
+        sqlite3_stmt *st = stmtGet(ctx, STMT_BLOCK_INSERT);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64 (st, 1, tagId);
+        sqlite3_bind_int64 (st, 2, samples[i].ts);
+        sqlite3_bind_int64 (st, 3, samples[i + n - 1].ts);
+        sqlite3_bind_int   (st, 4, n);
+        sqlite3_bind_blob  (st, 5, data, bytes, SQLITE_STATIC);
+        rc = stmtExec(ctx, st);
+    }
+    return rc;
+}
+
+/**
+ * \brief Store samples of one tag
+ *        Samples after the last block start new blocks once it is full.
+ *        Anything else is merged into the block whose range it falls in,
+ *        which is decoded, merged and written again, split if needed
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param samples The samples, in time order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+int blockStore (rollupCtx *ctx, int64_t tagId, const rollupSample *samples, int count) {
+    int rc = SQLITE_OK;
+    int i = 0;
+    while (i < count && rc == SQLITE_OK) {
+        sqlite3_stmt *st = stmtGet(ctx, STMT_BLOCK_FIND);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64 (st, 1, tagId);
+        sqlite3_bind_int64 (st, 2, samples[i].ts);
+        // the block holding samples[i] if any, and where the next one starts
+        int found = 0;
+        int64_t t0 = 0, t1 = 0, next = INT64_MAX;
+        int blockCount = 0;
+        rollupSample *merged = NULL;
+        if ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+            found = sqlite3_column_type(st, 0) != SQLITE_NULL;
+            t0 = sqlite3_column_int64(st, 0);
+            t1 = sqlite3_column_int64(st, 1);
+            blockCount = sqlite3_column_int(st, 2);
+            if (sqlite3_column_type(st, 4) != SQLITE_NULL) {
+                next = sqlite3_column_int64(st, 4);
+            }
+            rc = SQLITE_OK;
+        }
+        int j = i;
+        while (j < count && samples[j].ts < next) {
+            j++;
+        }
+        if (rc == SQLITE_OK && found && !(blockCount >= BLOCK_SAMPLES && samples[i].ts > t1)) {
+            merged = malloc((size_t)(blockCount + j - i) * sizeof (rollupSample));
+            if (merged == NULL) {
+                rc = SQLITE_NOMEM;
+            } else {
+                blockDecoder d;
+                rollupSample s;
+                int a = 0, n = 0;
+                blockDecodeBegin(&d, sqlite3_column_blob(st, 3), sqlite3_column_bytes(st, 3), blockCount);
+                s.tagId = tagId;
+                int more = blockDecodeNext(&d, &s.ts, &s.value);
+                while (more || a < j - i) {
+                    if (more && (a == j - i || s.ts <= samples[i + a].ts)) {
+                        merged[n++] = s;
+                        more = blockDecodeNext(&d, &s.ts, &s.value);
+                    } else {
+                        merged[n++] = samples[i + a++];
+                    }
+                }
+                sqlite3_reset(st);
+                sqlite3_stmt *del = stmtGet(ctx, STMT_BLOCK_DELETE);
+                if (del == NULL) {
+                    rc = SQLITE_ERROR;
+                } else {
+                    sqlite3_bind_int64 (del, 1, tagId);
+                    sqlite3_bind_int64 (del, 2, t0);
+                    rc = stmtExec(ctx, del);
+                }
+                if (rc == SQLITE_OK) {
+                    rc = blockWrite(ctx, tagId, merged, n);
+                }
+                free(merged);
+            }
+        } else if (rc == SQLITE_OK) {
+            sqlite3_reset(st);
+            rc = blockWrite(ctx, tagId, &samples[i], j - i);
+        }
+        sqlite3_reset(st);
+        i = j;
+    }
+    return rc;
+}
+
+/**
+ * \brief Get a block decoded, from the cache when it holds the same bytes
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param t0 The block start
+ * @param count How many samples the block holds
+ * @param data The block
+ * @param bytes The block size
+ * @return The decoded block, NULL if out of memory or not a block
+ */
+static const blockCache *blockLoad (rollupCtx *ctx, int64_t tagId, int64_t t0, int count, const void *data, int bytes) {
+    blockCache *c = ctx->blockCache;
+    if (count < 0 || count > BLOCK_SAMPLES || bytes < 0 || bytes > BLOCK_BYTES_MAX) {
+        return NULL;
+    }
+    if (c == NULL && (c = ctx->blockCache = malloc(sizeof (blockCache))) == NULL) {
+        return NULL;
+    }
+    if (c->count > 0 && c->tagId == tagId && c->t0 == t0 && c->bytes == bytes &&
+        memcmp(c->data, data, bytes) == 0) {
+        return c;
+    }
+    blockDecoder d;
+    int n = 0;
+    blockDecodeBegin(&d, data, bytes, count);
+    while (blockDecodeNext(&d, &c->ts[n], &c->value[n])) {
+        n++;
+    }
+    c->tagId = tagId;
+    c->t0 = t0;
+    c->count = n;
+    c->bytes = bytes;
+    memcpy(c->data, data, bytes);
+    return c;
+}
+
+/**
+ * \brief Release the decoded block cache of a connection
+ * @param ctx The connection context
+ */
+void blockCacheFree (rollupCtx *ctx) {
+    free(ctx->blockCache);
+    ctx->blockCache = NULL;
+}
+
+/**
+ * \brief Start reading the samples of a tag in (from, to]
+ * @param ctx The connection context
+ * @param it The iterator
+ * @param tagId The tag ID
+ * @param from Samples after this time stamp
+ * @param to Samples up to this time stamp
+ * @return 0 if all good
+ */
+int blockIterBegin (rollupCtx *ctx, blockIter *it, int64_t tagId, int64_t from, int64_t to) {
+    memset(it, 0, sizeof (*it));
+    it->st = stmtGet(ctx, STMT_BLOCK_RANGE);
+    if (it->st == NULL) {
+        return SQLITE_ERROR;
+    }
+    it->ctx = ctx;
+    it->tagId = tagId;
+    it->from = from;
+    it->to = to;
+    sqlite3_bind_int64 (it->st, 1, tagId);
+    sqlite3_bind_int64 (it->st, 2, from);
+    sqlite3_bind_int64 (it->st, 3, to);
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Read the next sample
+ * @param it The iterator
+ * @param ts The time stamp
+ * @param value The value
+ * @return SQLITE_ROW with a sample, SQLITE_DONE at the end, or an error
+ */
+int blockIterNext (blockIter *it, int64_t *ts, double *value) {
+    while (!it->done) {
+        if (it->block != NULL && it->pos < it->block->count) {
+            *ts = it->block->ts[it->pos];
+            if (*ts > it->to) {
+                break;
+            }
+            *value = it->block->value[it->pos++];
+            return SQLITE_ROW;
+        }
+        int rc = sqlite3_step(it->st);
+        if (rc != SQLITE_ROW) {
+            return rc;
+        }
+        it->block = blockLoad(it->ctx, it->tagId, sqlite3_column_int64(it->st, 0), sqlite3_column_int(it->st, 1),
+                              sqlite3_column_blob(it->st, 2), sqlite3_column_bytes(it->st, 2));
+        if (it->block == NULL) {
+            return SQLITE_NOMEM;
+        }
+        // first sample after from
+        int lo = 0, hi = it->block->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (it->block->ts[mid] <= it->from) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        it->pos = lo;
+    }
+    it->done = 1;
+    return SQLITE_DONE;
+}
+
+/**
+ * \brief Release the iterator statement
+ * @param it The iterator
+ */
+void blockIterEnd (blockIter *it) {
+    if (it->st != NULL) {
+        sqlite3_reset(it->st);
+        it->st = NULL;
+    }
+}
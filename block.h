@@ -0,0 +1,99 @@
+/*
+ * Compressed block store for raw samples
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+/*
+ * Raw samples of one tag packed into HistoryBlock rows of up to
+ * BLOCK_SAMPLES samples, in time order and never overlapping. Time stamps
+ * are stored as delta of delta and values as the XOR with the previous one
+ * (Gorilla, Pelkonen et al. 2015), so a regular series costs a couple of
+ * bits per time stamp and a few bits per slowly changing value.
+ */
+#define BLOCK_SAMPLES   512
+#define BLOCK_BYTES_MAX (16 + BLOCK_SAMPLES * 20)  // worst case of the encoding
+
+/*
+ * Bit level reader over one block
+ */
+typedef struct blockDecoder {
+    const uint8_t *data;
+    size_t bits;
+    size_t pos;
+    int remaining;
+    int64_t ts;
+    int64_t delta;
+    uint64_t value;
+    int lead;
+    int trail;
+} blockDecoder;
+
+/*
+ * The last block decoded on a connection. Hour jobs run in (tag, ts) order,
+ * so most of them find their samples here and decode nothing. It is keyed
+ * on the block content, so a block rewritten by anyone is never served stale
+ */
+typedef struct blockCache {
+    int64_t tagId;
+    int64_t t0;
+    int count;
+    int bytes;
+    uint8_t data[BLOCK_BYTES_MAX];
+    int64_t ts[BLOCK_SAMPLES];
+    double value[BLOCK_SAMPLES];
+} blockCache;
+
+/*
+ * Samples of one tag in a time range, block after block
+ */
+typedef struct blockIter {
+    rollupCtx *ctx;
+    sqlite3_stmt *st;
+    int64_t tagId;
+    int64_t from;
+    int64_t to;
+    const blockCache *block;
+    int pos;
+    int done;
+} blockIter;
+
+int blockStore (rollupCtx *ctx, int64_t tagId, const rollupSample *samples, int count);
+int blockIterBegin (rollupCtx *ctx, blockIter *it, int64_t tagId, int64_t from, int64_t to);
+int blockIterNext (blockIter *it, int64_t *ts, double *value);
+void blockIterEnd (blockIter *it);
+void blockCacheFree (rollupCtx *ctx);
+
+#endif
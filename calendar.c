@@ -0,0 +1,534 @@
+/*
+ * Calendar boundaries in local time
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "calendar.h"
+
+#define CAL_FIRST_YEAR  1970
+#define CAL_LAST_YEAR   2100
+#define DAY_SECONDS     86400
+#define MAX_OFFSET      (15 * 3600)
+
+/*
+ * One entry per UTC offset change of the local time zone
+ */
+typedef struct calTransition {
+    int64_t utc;        // first second the offset applies to
+    int32_t offset;     // seconds east of UTC
+} calTransition;
+
+static calTransition *calTable;
+static int calCount;
+static int64_t calLow;
+static int64_t calHigh;
+static pthread_once_t calOnce = PTHREAD_ONCE_INIT;
+static __thread int calHint;
+
+static int64_t floorDiv (int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+static int64_t floorMod (int64_t a, int64_t b) {
+    return a - floorDiv(a, b) * b;
+}
+
+/**
+ * \brief Days since 1970-01-01 of a civil date
+ *        Month and day may be out of range, they are normalized like mktime does
+ * @param y The year
+ * @param m The month, 1 to 12
+ * @param d The day of the month, 1 based
+ * @return The day number
+ */
+static int64_t daysFromCivil (int64_t y, int64_t m, int64_t d) {
+    y += floorDiv(m - 1, 12);
+    m = floorMod(m - 1, 12) + 1;
+    y -= m <= 2;
+    int64_t era = floorDiv(y, 400);
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**
+ * \brief Civil date of a day number
+ * @param z Days since 1970-01-01
+ * @param y The year
+ * @param m The month, 1 to 12
+ * @param d The day of the month, 1 based
+ */
+static void civilFromDays (int64_t z, int64_t *y, int64_t *m, int64_t *d) {
+    z += 719468;
+    int64_t era = floorDiv(z, 146097);
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+static long libcOffset (time_t ts) {
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    return tm.tm_gmtoff;
+}
+
+static void calPush (int64_t utc, int32_t offset, int *capacity) {
+    if (calCount == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        calTable = realloc(calTable, *capacity * sizeof (calTransition));
+        if (calTable == NULL) {
+            fprintf (stderr, "Out of memory building the calendar\n");
+            exit(1);
+        }
+    }
+    calTable[calCount].utc = utc;
+    calTable[calCount].offset = offset;
+    calCount++;
+}
+
+/**
+ * \brief Build the transition table of the local time zone
+ *        The zone is probed once a day and every offset change found is
+ *        narrowed down to the second by bisection
+ */
+static void calendarInit (void) {
+    int capacity = 0;
+    tzset();
+    calLow = daysFromCivil(CAL_FIRST_YEAR, 1, 1) * DAY_SECONDS;
+    calHigh = daysFromCivil(CAL_LAST_YEAR + 1, 1, 1) * DAY_SECONDS;
+    long prev = libcOffset(calLow);
+    calPush(calLow, prev, &capacity);
+    int64_t t;
+    for (t = calLow + DAY_SECONDS; t <= calHigh; t += DAY_SECONDS) {
+        long offset = libcOffset(t);
+        if (offset != prev) {
+            int64_t lo = t - DAY_SECONDS;
+            int64_t hi = t;
+            while (hi - lo > 1) {
+                int64_t mid = lo + (hi - lo) / 2;
+                if (libcOffset(mid) == prev) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            calPush(hi, offset, &capacity);
+            prev = offset;
+        }
+    }
+}
+
+/**
+ * \brief Check the time stamp is covered by the transition table
+ * @param ts The time stamp
+ * @return Non zero when the table can answer for it
+ */
+static int calCovers (time_t ts) {
+    pthread_once(&calOnce, calendarInit);
+    return ts >= calLow + 2 * DAY_SECONDS && ts < calHigh - 2 * DAY_SECONDS;
+}
+
+/**
+ * \brief Find the table entry in effect at a time stamp
+ *        The last entry found is remembered per thread, as the engine asks
+ *        for long runs of nearby time stamps
+ * @param utc The time stamp
+ * @return The entry index
+ */
+static int calIndex (int64_t utc) {
+    int i = calHint;
+    if (i < calCount && calTable[i].utc <= utc && (i + 1 == calCount || utc < calTable[i + 1].utc)) {
+        return i;
+    }
+    int lo = 0;
+    int hi = calCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (calTable[mid].utc <= utc) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    calHint = lo;
+    return lo;
+}
+
+static int32_t calOffset (int64_t utc) {
+    return calTable[calIndex(utc)].offset;
+}
+
+/**
+ * \brief Convert a local wall clock time to UTC
+ *        A wall time repeated by a backward transition resolves to its first
+ *        occurrence. A wall time skipped by a forward transition resolves to
+ *        the first second after the gap, which is where the local day, month
+ *        or year really starts
+ * @param local Seconds since 1970-01-01 in local wall clock
+ * @return The time stamp
+ */
+static int64_t localToUtc (int64_t local) {
+    int i = calIndex(local - MAX_OFFSET);
+    int last = calIndex(local + MAX_OFFSET);
+    for (; i <= last; i++) {
+        int64_t utc = local - calTable[i].offset;
+        if (utc < calTable[i].utc) {
+            return calTable[i].utc;
+        }
+        if (i + 1 == calCount || utc < calTable[i + 1].utc) {
+            return utc;
+        }
+    }
+    return local - calTable[last].offset;
+}
+
+/*
+ * The libc versions. They answer outside the transition table and are the
+ * baseline of calendarBench
+ */
+
+static time_t libcAddYear (time_t ts) {
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    tm.tm_year++;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcAddMonth (time_t ts) {
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    tm.tm_mon++;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcAddDay (time_t ts) {
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    tm.tm_mday++;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfYear (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_mday = 1;
+    tm.tm_mon = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfQuarter (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_mday = 1;
+    tm.tm_mon -= tm.tm_mon % 3;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfMonth (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_mday = 1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfDay (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfWeek (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour = 0;
+    tm.tm_mday -= (tm.tm_wday + 6) % 7;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static time_t libcStartOfInterval (time_t ts, int seconds) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    return ts - floorMod(ts + tm.tm_gmtoff, seconds);
+}
+
+static time_t libcStartOfHour (time_t ts) {
+    struct tm tm;
+    localtime_r (&ts, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    return mktime(&tm);
+}
+
+/**
+ * \brief Add one year to the time stamp
+ * @param ts The time stamp
+ * @return The adjusted time stamp
+ */
+time_t timeAddYear (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcAddYear(ts);
+    }
+    int64_t y, m, d;
+    int64_t local = ts + calOffset(ts);
+    int64_t days = floorDiv(local, DAY_SECONDS);
+    civilFromDays(days, &y, &m, &d);
+    return localToUtc(daysFromCivil(y + 1, m, d) * DAY_SECONDS + (local - days * DAY_SECONDS));
+}
+
+/**
+ * \brief Add one month to the time stamp
+ * @param ts The time stamp
+ * @return The adjusted time stamp
+ */
+time_t timeAddMonth (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcAddMonth(ts);
+    }
+    int64_t y, m, d;
+    int64_t local = ts + calOffset(ts);
+    int64_t days = floorDiv(local, DAY_SECONDS);
+    civilFromDays(days, &y, &m, &d);
+    return localToUtc(daysFromCivil(y, m + 1, d) * DAY_SECONDS + (local - days * DAY_SECONDS));
+}
+
+/**
+ * \brief Add one local day to the time stamp
+ *        Across a DST change the result is 23 or 25 hours later
+ * @param ts The time stamp
+ * @return The adjusted time stamp
+ */
+time_t timeAddDay (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcAddDay(ts);
+    }
+    return localToUtc(ts + calOffset(ts) + DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the year
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfYear (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfYear(ts);
+    }
+    int64_t y, m, d;
+    civilFromDays(floorDiv(ts + calOffset(ts), DAY_SECONDS), &y, &m, &d);
+    return localToUtc(daysFromCivil(y, 1, 1) * DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the quarter
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfQuarter (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfQuarter(ts);
+    }
+    int64_t y, m, d;
+    civilFromDays(floorDiv(ts + calOffset(ts), DAY_SECONDS), &y, &m, &d);
+    return localToUtc(daysFromCivil(y, m - (m - 1) % 3, 1) * DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the month
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfMonth (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfMonth(ts);
+    }
+    int64_t y, m, d;
+    civilFromDays(floorDiv(ts + calOffset(ts), DAY_SECONDS), &y, &m, &d);
+    return localToUtc(daysFromCivil(y, m, 1) * DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the day
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfDay (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfDay(ts);
+    }
+    return localToUtc(floorDiv(ts + calOffset(ts), DAY_SECONDS) * DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the ISO week, a Monday
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfWeek (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfWeek(ts);
+    }
+    int64_t days = floorDiv(ts + calOffset(ts), DAY_SECONDS);
+    // 1970-01-01 was a Thursday
+    return localToUtc((days - floorMod(days + 3, 7)) * DAY_SECONDS);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of a slice of the local day
+ * @param ts The time stamp
+ * @param seconds The slice length, a divisor of a day
+ * @return Adjusted time stamp
+ */
+time_t getStartOfInterval (time_t ts, int seconds) {
+    if (!calCovers(ts)) {
+        return libcStartOfInterval(ts, seconds);
+    }
+    return ts - floorMod(ts + calOffset(ts), seconds);
+}
+
+/**
+ * \brief Adjust the time stamp for the beginning of the hour
+ * @param ts The time stamp
+ * @return Adjusted time stamp
+ */
+time_t getStartOfHour (time_t ts) {
+    if (!calCovers(ts)) {
+        return libcStartOfHour(ts);
+    }
+    return ts - floorMod(ts + calOffset(ts), 3600);
+}
+
+/**
+ * \brief Monotonic clock
+ * @return Nanoseconds since an arbitrary point
+ */
+int64_t monotonicNanos (void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * \brief Monotonic clock
+ * @return Seconds since an arbitrary point
+ */
+double monotonicSeconds (void) {
+    return monotonicNanos() / 1e9;
+}
+
+/**
+ * \brief Time the table driven functions against the libc ones
+ *        Both run over the same random time stamps between 2000 and 2030
+ * @param count How many time stamps
+ */
+void calendarBench (int count) {
+    static const struct {
+        const char *name;
+        time_t (*table)(time_t);
+        time_t (*libc)(time_t);
+    } fn[] = {
+        {"getStartOfHour",  getStartOfHour,  libcStartOfHour},
+        {"getStartOfDay",   getStartOfDay,   libcStartOfDay},
+        {"getStartOfMonth", getStartOfMonth, libcStartOfMonth},
+        {"getStartOfYear",  getStartOfYear,  libcStartOfYear},
+        {"timeAddDay",      timeAddDay,      libcAddDay},
+        {"timeAddMonth",    timeAddMonth,    libcAddMonth},
+        {"timeAddYear",     timeAddYear,     libcAddYear}
+    };
+    time_t *ts = malloc(count * sizeof (time_t));
+    time_t *out = malloc(count * sizeof (time_t));
+    if (ts == NULL || out == NULL) {
+        free(ts);
+        free(out);
+        return;
+    }
+    uint64_t seed = 88172645463325252ULL;
+    int64_t low = daysFromCivil(2000, 1, 1) * DAY_SECONDS;
+    int64_t span = daysFromCivil(2030, 1, 1) * DAY_SECONDS - low;
+    int i, f;
+    for (i = 0; i < count; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        ts[i] = low + (int64_t)(seed % (uint64_t)span);
+    }
+    double start = monotonicSeconds();
+    calCovers(0);
+    printf ("Calendar table: %d transitions built in %.3f ms\n",
+            calCount, (monotonicSeconds() - start) * 1000);
+    for (f = 0; f < (int)(sizeof (fn) / sizeof (fn[0])); f++) {
+        int differ = 0;
+        start = monotonicSeconds();
+        for (i = 0; i < count; i++) {
+            out[i] = fn[f].libc(ts[i]);
+        }
+        double libc = monotonicSeconds() - start;
+        start = monotonicSeconds();
+        for (i = 0; i < count; i++) {
+            differ += fn[f].table(ts[i]) != out[i];
+        }
+        double table = monotonicSeconds() - start;
+        printf ("%-16s libc %7.1f ns  table %6.1f ns  speedup %5.1fx  %d results differ\n",
+                fn[f].name, libc * 1e9 / count, table * 1e9 / count, libc / table, differ);
+    }
+    free(ts);
+    free(out);
+}
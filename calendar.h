@@ -0,0 +1,60 @@
+/*
+ * Calendar boundaries in local time
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CALENDAR_H
+#define CALENDAR_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * All functions work on the local time zone (TZ) as it was when the first
+ * one was called. The UTC offset transitions of the zone are read once into
+ * a table and every later query is plain integer arithmetic.
+ */
+time_t getStartOfYear (time_t ts);
+time_t getStartOfQuarter (time_t ts);
+time_t getStartOfMonth (time_t ts);
+time_t getStartOfWeek (time_t ts);
+time_t getStartOfDay (time_t ts);
+time_t getStartOfHour (time_t ts);
+time_t getStartOfInterval (time_t ts, int seconds);
+time_t timeAddYear (time_t ts);
+time_t timeAddMonth (time_t ts);
+time_t timeAddDay (time_t ts);
+void calendarBench (int count);
+
+/*
+ * The clock every timing of the program reads
+ */
+int64_t monotonicNanos (void);
+double monotonicSeconds (void);
+
+#endif
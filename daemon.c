@@ -0,0 +1,199 @@
+/*
+ * Roll up daemon
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+/*
+ * The daemon stays on one connection, so statements are prepared once and
+ * the job table is only read when something may have changed. It wakes up
+ * when another connection commits, which PRAGMA data_version tells at the
+ * cost of a page read, and every tick anyway. Levels are drained finest
+ * first in slices of at most cfg->slice jobs, each one committed on its
+ * own, and SIGTERM or SIGINT is only looked at between two slices. Jobs
+ * left over stay in the job table for the next start.
+ */
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void stopSignal (int sig) {
+    stopRequested = 1;
+}
+
+/**
+ * \brief Read the data version of the database
+ *        It changes whenever another connection commits
+ * @param ctx The connection context
+ * @param version The data version
+ * @return 0 if all good
+ */
+static int dataVersion (rollupCtx *ctx, int64_t *version) {
+    sqlite3_stmt *st = stmtGet(ctx, STMT_DATA_VERSION);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    int rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW) {
+        *version = sqlite3_column_int64(st, 0);
+        rc = SQLITE_OK;
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+/**
+ * \brief Print the roll up lag of every level
+ *        For each level the jobs waiting and how long ago the oldest
+ *        bucket not rolled up started, a job or, with ctx->watermark, the
+ *        lowest watermark
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+static int daemonReport (rollupCtx *ctx) {
+    int64_t *backlog = ctx->metrics.backlog;
+    rollupStore *s = ctx->store;
+    time_t now = time(NULL);
+    char dt[32];
+    int i;
+    int rc = rollupBacklog(ctx);
+    printf ("%s Lag:", tt2iso8602(now, dt));
+    for (i = 0; i < levelCount(); i++) {
+        int type = levelAt(i);
+        int64_t oldest;
+        printf ("%s %" PRId64 " %s", i > 0 ? "," : "", backlog[type], levelName(type));
+        int found = rc == SQLITE_OK && backlog[type] > 0 &&
+                    s->methods->xJobOldest(s, 0, type, &oldest) == SQLITE_OK;
+        int64_t mark;
+        if (ctx->watermark && s->methods->xMarkGet(s, 0, type, &mark) == SQLITE_OK &&
+            (!found || mark < oldest)) {
+            oldest = mark;
+            found = 1;
+        }
+        if (found) {
+            printf (" %" PRId64 " s", (int64_t)now - oldest);
+        }
+    }
+    printf ("; %" PRId64 " jobs done\n", ctx->jobs);
+    fflush(stdout);
+    return rc;
+}
+
+/**
+ * \brief Roll up every level, finest first, one slice at a time
+ * @param ctx The connection context
+ * @param cfg The daemon configuration
+ * @param nextReport When the next lag report is due, in monotonic seconds
+ * @return 0 if all good
+ */
+static int daemonDrain (rollupCtx *ctx, const daemonConfig *cfg, double *nextReport) {
+    int rc = jobFlush(ctx);
+    int i = 0;
+    while (i < levelCount() && rc == SQLITE_OK && !stopRequested) {
+        int64_t done = 0;
+        rc = rollupSlice(ctx, levelAt(i), cfg->slice, &done);
+        if (cfg->slice == 0 || done < cfg->slice) {
+            i++;
+        }
+        if (metricsDumpPending()) {
+            rollupBacklog(ctx);
+            metricsDump(&ctx->metrics, stdout);
+        }
+        if (monotonicSeconds() >= *nextReport) {
+            daemonReport(ctx);
+            *nextReport = monotonicSeconds() + cfg->tick;
+        }
+    }
+    return rc;
+}
+
+/**
+ * \brief Run as a daemon until SIGTERM or SIGINT
+ *        A roll up that fails is rolled back and tried again at the next
+ *        tick
+ * @param ctx The connection context, on the sqlite backend
+ * @param cfg The daemon configuration
+ * @return 0 if all good
+ */
+int daemonRun (rollupCtx *ctx, const daemonConfig *cfg) {
+    struct sigaction sa;
+    struct timespec poll = {DAEMON_POLL_MILLIS / 1000, (DAEMON_POLL_MILLIS % 1000) * 1000000L};
+    int64_t version = -1;
+    int64_t wakeups = 0;
+    double nextTick = 0;
+    double nextReport = 0;
+    int rc = SQLITE_OK;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = stopSignal;     // no SA_RESTART, so the signal cuts the sleep short
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    stopRequested = 0;
+    sqlite3_busy_timeout(ctx->db, DAEMON_BUSY_MILLIS);
+    printf ("Daemon started, tick %d s, slice %d jobs\n", cfg->tick, cfg->slice);
+    fflush(stdout);
+    while (!stopRequested) {
+        int64_t v = version;
+        if ((rc = dataVersion(ctx, &v)) != SQLITE_OK) {
+            printf ("Reading the data version failed (%d) %s\n", rc, sqlite3_errmsg(ctx->db));
+        }
+        double now = monotonicSeconds();
+        if (v != version || now >= nextTick) {
+            version = v;
+            nextTick = now + cfg->tick;
+            wakeups++;
+            if ((rc = daemonDrain(ctx, cfg, &nextReport)) != SQLITE_OK) {
+                printf ("Roll up failed (%d) %s, retrying at the next tick\n", rc, sqlite3_errmsg(ctx->db));
+            }
+        }
+        if (metricsDumpPending()) {
+            rollupBacklog(ctx);
+            metricsDump(&ctx->metrics, stdout);
+        }
+        if (monotonicSeconds() >= nextReport) {
+            daemonReport(ctx);
+            nextReport = monotonicSeconds() + cfg->tick;
+        }
+        if (!stopRequested) {
+            nanosleep(&poll, NULL);
+        }
+    }
+    rc = jobFlush(ctx);
+    daemonReport(ctx);
+    printf ("Daemon stopped after %" PRId64 " wake ups\n", wakeups);
+    fflush(stdout);
+    return rc;
+}
@@ -0,0 +1,222 @@
+/*
+ * Per tag dirty hour ranges
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "rollup.h"
+#include "dirtyrange.h"
+
+/**
+ * \brief Find a tag, adding it if needed
+ * @param t The tracker
+ * @param tagId The tag ID
+ * @return The tag, NULL if out of memory
+ */
+static dirtyTag *dirtyTagGet (dirtyTracker *t, int64_t tagId) {
+    if (t->last < t->count && t->tags[t->last].tagId == tagId) {
+        return &t->tags[t->last];
+    }
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->tags[mid].tagId < tagId) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == t->count || t->tags[lo].tagId != tagId) {
+        if (t->count == t->capacity) {
+            int capacity = t->capacity ? t->capacity * 2 : 64;
+            dirtyTag *tags = realloc(t->tags, capacity * sizeof (dirtyTag));
+            if (tags == NULL) {
+                return NULL;
+            }
+            t->tags = tags;
+            t->capacity = capacity;
+        }
+        memmove(&t->tags[lo + 1], &t->tags[lo], (t->count - lo) * sizeof (dirtyTag));
+        memset(&t->tags[lo], 0, sizeof (dirtyTag));
+        t->tags[lo].tagId = tagId;
+        t->count++;
+    }
+    t->last = lo;
+    return &t->tags[lo];
+}
+
+/**
+ * \brief Mark a bucket of the finest level of a tag dirty
+ *        The bucket joins the range it falls in or touches, so ranges stay
+ *        sorted and apart by at least one clean bucket. Calendar buckets
+ *        are taken at their average length, a range may then end right
+ *        where the next one starts, which only costs a range
+ * @param t The tracker
+ * @param tagId The tag ID
+ * @param start The bucket start
+ * @return 0 if all good
+ */
+int dirtyAdd (dirtyTracker *t, int64_t tagId, int64_t start) {
+    dirtyTag *tag = dirtyTagGet(t, tagId);
+    if (tag == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int64_t step = levelGet(levelAt(0))->seconds;
+    dirtyRange *r = tag->ranges;
+    int n = tag->count;
+    int i;
+    // samples mostly come in time order, so try the last range first
+    if (n > 0 && start >= r[n - 1].first) {
+        i = n - 1;
+    } else {
+        int lo = 0, hi = n;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (r[mid].last + step < start) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        i = lo;
+    }
+    if (i < n && start >= r[i].first - step && start <= r[i].last + step) {
+        // the range before ends over a bucket earlier, only the next one may touch
+        if (start < r[i].first) {
+            r[i].first = start;
+        } else if (start > r[i].last) {
+            r[i].last = start;
+            if (i + 1 < n && start + step >= r[i + 1].first) {
+                r[i].last = r[i + 1].last;
+                memmove(&r[i + 1], &r[i + 2], (n - i - 2) * sizeof (dirtyRange));
+                tag->count--;
+            }
+        }
+        return SQLITE_OK;
+    }
+    if (i < n && start > r[i].last) {
+        i++;
+    }
+    if (n == tag->capacity) {
+        int capacity = tag->capacity ? tag->capacity * 2 : 8;
+        r = realloc(tag->ranges, capacity * sizeof (dirtyRange));
+        if (r == NULL) {
+            return SQLITE_NOMEM;
+        }
+        tag->ranges = r;
+        tag->capacity = capacity;
+    }
+    memmove(&r[i + 1], &r[i], (n - i) * sizeof (dirtyRange));
+    r[i].first = start;
+    r[i].last = start;
+    tag->count++;
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Visit every bucket the ranges of a tag touch, level by level and
+ *        in time order, each bucket once
+ * @param tag The tag
+ * @param from The first level, by position. See levelAt
+ * @param fn Called per bucket, may be NULL
+ * @param arg Passed to fn
+ * @param backlog Incremented per bucket by level, may be NULL
+ * @return 0 if all good, or what fn returned
+ */
+static int dirtyWalk (const dirtyTag *tag, int from, dirtyFn fn, void *arg, int64_t *backlog) {
+    int level, i;
+    for (level = from; level < levelCount(); level++) {
+        int type = levelAt(level);
+        int64_t next = INT64_MIN;   // buckets before this one are done
+        for (i = 0; i < tag->count; i++) {
+            int64_t b = bucketStart(type, tag->ranges[i].first);
+            if (b < next) {
+                b = next;
+            }
+            for (; b <= tag->ranges[i].last; b = bucketNext(type, b)) {
+                int rc = fn != NULL ? fn(arg, tag->tagId, type, b) : SQLITE_OK;
+                if (rc != SQLITE_OK) {
+                    return rc;
+                }
+                if (backlog != NULL) {
+                    backlog[type]++;
+                }
+            }
+            next = b;
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Hand every dirty bucket to fn and forget them
+ * @param t The tracker
+ * @param from The first level to schedule, by position. See levelAt
+ * @param fn Called per bucket
+ * @param arg Passed to fn
+ * @return 0 if all good, or what fn returned. The tracker is empty anyway
+ */
+int dirtyDrain (dirtyTracker *t, int from, dirtyFn fn, void *arg) {
+    int rc = SQLITE_OK;
+    int i;
+    for (i = 0; i < t->count && rc == SQLITE_OK; i++) {
+        rc = dirtyWalk(&t->tags[i], from, fn, arg, NULL);
+    }
+    dirtyClear(t);
+    return rc;
+}
+
+/**
+ * \brief Count the dirty buckets per level
+ * @param t The tracker
+ * @param from The first level, by position. See levelAt
+ * @param backlog Incremented by level
+ */
+void dirtyBacklog (const dirtyTracker *t, int from, int64_t *backlog) {
+    int i;
+    for (i = 0; i < t->count; i++) {
+        dirtyWalk(&t->tags[i], from, NULL, NULL, backlog);
+    }
+}
+
+void dirtyClear (dirtyTracker *t) {
+    int i;
+    for (i = 0; i < t->count; i++) {
+        free(t->tags[i].ranges);
+    }
+    t->count = 0;
+    t->last = 0;
+}
+
+void dirtyFree (dirtyTracker *t) {
+    dirtyClear(t);
+    free(t->tags);
+    memset(t, 0, sizeof (*t));
+}
@@ -0,0 +1,75 @@
+/*
+ * Per tag dirty hour ranges
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef DIRTYRANGE_H
+#define DIRTYRANGE_H
+
+#include <stdint.h>
+
+/*
+ * Consecutive buckets of the finest level of one tag that got new samples,
+ * by bucket start, both ends included
+ */
+typedef struct dirtyRange {
+    int64_t first;
+    int64_t last;
+} dirtyRange;
+
+/*
+ * The ranges of one tag, sorted and never touching each other
+ */
+typedef struct dirtyTag {
+    int64_t tagId;
+    dirtyRange *ranges;
+    int count;
+    int capacity;
+} dirtyTag;
+
+/*
+ * Buckets touched since the last drain, per tag. A device upload of days of
+ * late data collapses into one range per gap, so each bucket of every
+ * level above it is scheduled once, whatever the order the samples came in
+ */
+typedef struct dirtyTracker {
+    dirtyTag *tags;         // sorted by tag ID
+    int count;
+    int capacity;
+    int last;               // index of the last tag added to
+} dirtyTracker;
+
+typedef int (*dirtyFn) (void *arg, int64_t tagId, int type, int64_t ts);
+
+int dirtyAdd (dirtyTracker *t, int64_t tagId, int64_t start);
+int dirtyDrain (dirtyTracker *t, int from, dirtyFn fn, void *arg);
+void dirtyBacklog (const dirtyTracker *t, int from, int64_t *backlog);
+void dirtyClear (dirtyTracker *t);
+void dirtyFree (dirtyTracker *t);
+
+#endif
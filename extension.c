@@ -0,0 +1,129 @@
+/*
+ * The roll up engine as a loadable SQLite extension
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef ROLLUP_EXTENSION
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rollup.h"
+SQLITE_EXTENSION_INIT1
+
+/*
+ * The engine of one connection, owned by rollup_run()
+ */
+typedef struct extension {
+    rollupCtx ctx;
+    int schemaReady;
+} extension;
+
+/**
+ * \brief SQL function rollup_run([maxJobs])
+ *        Roll up every level, finest first, until maxJobs jobs are done or
+ *        none is left, and return how many were done. No maxJobs, or 0,
+ *        drains them all. Out of a transaction the work is committed in
+ *        batches, within one it joins it. Jobs are queued by whoever
+ *        writes the samples, in the Job table as ingestSamples does
+ * @param context The function context
+ * @param argc 0 or 1
+ * @param argv The job budget
+ */
+static void runFunc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    extension *e = sqlite3_user_data(context);
+    rollupCtx *ctx = &e->ctx;
+    int64_t budget = argc > 0 ? sqlite3_value_int64(argv[0]) : 0;
+    int64_t total = 0;
+    int rc = SQLITE_OK;
+    int i = 0;
+    if (!e->schemaReady) {
+        rc = ensureSchema(ctx->db);
+        if (rc == SQLITE_OK) {
+            rc = settingsLoad(ctx, NULL, 0);
+        }
+        e->schemaReady = rc == SQLITE_OK;
+    }
+    while (i < levelCount() && rc == SQLITE_OK && (budget <= 0 || total < budget)) {
+        int64_t left = budget - total;
+        int slice = budget <= 0 ? 0 : left > INT_MAX ? INT_MAX : (int)left;
+        int64_t done = 0;
+        rc = rollupSlice(ctx, levelAt(i), slice, &done);
+        total += done;
+        if (slice == 0 || done < slice) {
+            i++;
+        }
+    }
+    // nothing is kept prepared between calls, so the host can close
+    stmtFinalize(ctx);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+    sqlite3_result_int64(context, total);
+}
+
+static void runDestroy (void *arg) {
+    extension *e = arg;
+    rollupCtxRelease(&e->ctx);
+    sqlite3_free(e);
+}
+
+/**
+ * \brief Entry point of load_extension('rollup')
+ *        Registers the roll up SQL functions, rollup_series and
+ *        rollup_run on the connection. rollup_run takes the levels and
+ *        the watermark mode stored in the database, see settingsLoad. The
+ *        engine lives until the connection closes
+ * @param db The database connection
+ * @param err The error message, if any
+ * @param api The SQLite API of the host
+ * @return 0 if all good
+ */
+__attribute__ ((visibility ("default")))
+int sqlite3_rollup_init (sqlite3 *db, char **err, const sqlite3_api_routines *api) {
+    extension *e;
+    int rc;
+    SQLITE_EXTENSION_INIT2(api);
+    e = sqlite3_malloc(sizeof (*e));
+    if (e == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(e, 0, sizeof (*e));
+    rollupCtxInit(&e->ctx, db);
+    // the one-argument flavor owns the engine, freed when db closes or
+    // right away if it cannot be registered
+    rc = sqlite3_create_function_v2(db, "rollup_run", 1, SQLITE_UTF8, e, runFunc, NULL, NULL, runDestroy);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function_v2(db, "rollup_run", 0, SQLITE_UTF8, e, runFunc, NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_mprintf("rollup: %s", sqlite3_errmsg(db));
+    }
+    return rc;
+}
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Bulk ingest of raw samples
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+#define BENCH_BATCH     65536
+
+static int sampleCompare (const void *a, const void *b) {
+    const rollupSample *x = a;
+    const rollupSample *y = b;
+    if (x->tagId != y->tagId) {
+        return x->tagId < y->tagId ? -1 : 1;
+    }
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+static int samplesSorted (const rollupSample *samples, int count) {
+    int i;
+    for (i = 1; i < count; i++) {
+        if (sampleCompare(&samples[i - 1], &samples[i]) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief Mark every bucket of the finest level the samples fall in dirty
+ *        A run of samples in the same bucket of the same tag marks it once.
+ *        The jobs of all levels are queued from the dirty ranges on flush
+ * @param ctx The connection context
+ * @param in The samples, best in (tag, ts) order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+static int queueBuckets (rollupCtx *ctx, const rollupSample *in, int count) {
+    int rc = SQLITE_OK;
+    int base = levelAt(0);
+    int64_t lastTag = 0;
+    int64_t lastStart = 0;
+    int64_t lastEnd = 0;
+    int known = 0;
+    int i;
+    for (i = 0; i < count && rc == SQLITE_OK; i++) {
+        int64_t t = in[i].ts - 1;
+        if (known && in[i].tagId == lastTag && t >= lastStart && t < lastEnd) {
+            continue;
+        }
+        lastTag = in[i].tagId;
+        lastStart = bucketStart(base, t);
+        lastEnd = bucketNext(base, lastStart);
+        rc = dirtyAdd(&ctx->ranges, lastTag, lastStart);
+        known = 1;
+    }
+    return rc;
+}
+
+/**
+ * \brief Fold the samples into their buckets of the finest level and mark
+ *        them dirty
+ *        A run of samples in the same bucket of the same tag becomes one
+ *        delta, merged with one statement. The bucket is never read back
+ *        from History
+ * @param ctx The connection context
+ * @param in The samples, best in (tag, ts) order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+static int mergeBuckets (rollupCtx *ctx, const rollupSample *in, int count, int expired) {
+    int rc = SQLITE_OK;
+    int base = levelAt(0);
+    rollupBucket delta;
+    int i = 0;
+    while (i < count && rc == SQLITE_OK) {
+        int64_t tagId = in[i].tagId;
+        int64_t start = bucketStart(base, in[i].ts - 1);   // a bucket holds (start, end]
+        int64_t end = bucketNext(base, start);
+        memset(&delta, 0, sizeof (delta));
+        for (; i < count && in[i].tagId == tagId && in[i].ts > start && in[i].ts <= end; i++) {
+            foldSample(&delta, in[i].value);
+        }
+        rc = mergeRollup(ctx, tagId, base, start, &delta);
+        if (rc == SQLITE_OK && expired) {
+            // a job of the finest level would roll it up from History again
+            const rollupLevel *level = levelGet(base);
+            int j;
+            for (j = 0; j < level->parentCount && rc == SQLITE_OK; j++) {
+                rc = updateRollupControl(ctx, tagId, level->parents[j], start);
+            }
+        } else if (rc == SQLITE_OK) {
+            rc = dirtyAdd(&ctx->ranges, tagId, start);
+        }
+    }
+    return rc;
+}
+
+/**
+ * \brief Merge the samples whose buckets the raw retention already purged
+ *        into the finest level, and leave out the others
+ *        The samples of a tag come in time order, so the purged ones are a
+ *        prefix of them. They are not stored raw: History no longer holds
+ *        the rest of their buckets, which must not be rolled up again
+ * @param ctx The connection context
+ * @param in The samples in (tag, ts) order, the ones left on return
+ * @param count How many, the ones left on return
+ * @param live The copy the samples left are in, NULL when all are
+ * @return 0 if all good
+ */
+static int mergeExpired (rollupCtx *ctx, const rollupSample **in, int *count, rollupSample **live) {
+    const rollupSample *s = *in;
+    int n = *count;
+    int base = levelAt(0);
+    int64_t now = time(NULL);
+    int kept = 0;
+    int i = 0;
+    int rc = SQLITE_OK;
+    while (i < n && rc == SQLITE_OK) {
+        int64_t tagId = s[i].tagId;
+        int64_t horizon;
+        int j = i;
+        int k = i;
+        while (j < n && s[j].tagId == tagId) {
+            j++;
+        }
+        rc = retentionHorizon(ctx, tagId, now, &horizon);
+        while (rc == SQLITE_OK && k < j && bucketStart(base, s[k].ts - 1) < horizon) {
+            k++;
+        }
+        if (rc == SQLITE_OK && k > i) {
+            rc = mergeBuckets(ctx, s + i, k - i, 1);
+            if (rc == SQLITE_OK && *live == NULL) {
+                if ((*live = malloc(n * sizeof (rollupSample))) == NULL) {
+                    rc = SQLITE_NOMEM;
+                } else {
+                    memcpy(*live, s, i * sizeof (rollupSample));
+                    kept = i;
+                }
+            }
+        }
+        if (rc == SQLITE_OK && *live != NULL) {
+            memcpy(*live + kept, s + k, (j - k) * sizeof (rollupSample));
+            kept += j - k;
+        }
+        i = j;
+    }
+    if (rc == SQLITE_OK && *live != NULL) {
+        *in = *live;
+        *count = kept;
+    }
+    return rc;
+}
+
+/**
+ * \brief Insert raw samples into the store and queue their buckets, or with
+ *        ctx->incremental merge them into the finest level right away
+ *        The store gets them in (tag, ts) order, so on SQLite the
+ *        History_Index01 pages are visited once and the blocks of
+ *        ctx->columnar are appended in order. Called outside a transaction
+ *        the whole array goes in one. Inside the caller's transaction, the
+ *        caller must jobFlush before commit. Samples whose buckets the raw
+ *        retention already purged are merged instead, see mergeExpired
+ * @param ctx The connection context
+ * @param samples The samples, in any order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+int ingestSamples (rollupCtx *ctx, const rollupSample *samples, int count) {
+    int rc = SQLITE_OK;
+    const rollupSample *in = samples;
+    rollupSample *sorted = NULL;
+    rollupSample *live = NULL;
+    if (!samplesSorted(samples, count)) {
+        if ((sorted = malloc(count * sizeof (rollupSample))) != NULL) {
+            memcpy(sorted, samples, count * sizeof (rollupSample));
+            qsort(sorted, count, sizeof (rollupSample), sampleCompare);
+            in = sorted;
+        } else if (ctx->columnar) {
+            return SQLITE_NOMEM;    // blocks can only take samples in order
+        }
+    }
+    rollupStore *s = ctx->store;
+    int own = s->methods->xAutocommit(s);
+    if (own && (rc = batchBegin(ctx)) != SQLITE_OK) {
+        free(sorted);
+        return rc;
+    }
+    rc = mergeExpired(ctx, &in, &count, &live);
+    if (rc == SQLITE_OK) {
+        rc = s->methods->xInsertSamples(s, in, count);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ctx->incremental ? mergeBuckets(ctx, in, count, 0) : queueBuckets(ctx, in, count);
+    }
+    if (own) {
+        rc = batchEnd(ctx, rc);
+    }
+    free(live);
+    free(sorted);
+    return rc;
+}
+
+/**
+ * \brief Measure the ingest rate
+ *        Samples arrive the way a collector delivers them: each batch holds
+ *        one minute after another for every tag
+ * @param ctx The connection context
+ * @param count How many samples in total
+ * @param tags How many tags
+ * @return 0 if all good
+ */
+int ingestBench (rollupCtx *ctx, int64_t count, int tags) {
+    int rc = SQLITE_OK;
+    rollupSample *batch = malloc(BENCH_BATCH * sizeof (rollupSample));
+    if (batch == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int64_t start = 1262304000;     // 2010-01-01T00:00:00Z
+    int64_t done = 0;
+    int64_t rows = ctx->jobRows;
+    double elapsed = 0;
+    while (done < count && rc == SQLITE_OK) {
+        int n = 0;
+        while (n < BENCH_BATCH && done + n < count) {
+            int64_t k = done + n;
+            batch[n].tagId = 1 + k % tags;
+            batch[n].ts = start + (k / tags) * 60;
+            batch[n].value = (double)(k % 100);
+            n++;
+        }
+        double t = monotonicSeconds();
+        rc = ingestSamples(ctx, batch, n);
+        elapsed += monotonicSeconds() - t;
+        done += n;
+    }
+    free(batch);
+    printf ("Ingest %" PRId64 " samples of %d tags in %.3f seconds (%.0f samples/s), %" PRId64 " jobs queued\n",
+            done, tags, elapsed, done / elapsed, ctx->jobRows - rows);
+    return rc;
+}
@@ -0,0 +1,154 @@
+/*
+ * Set of pending roll up jobs
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "jobset.h"
+
+#define JOBSET_MIN_CAPACITY 1024
+
+static uint64_t jobHash (const jobKey *key) {
+    uint64_t h = (uint64_t)key->tagId * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)key->ts + 0xBF58476D1CE4E5B9ULL + (h << 6) + (h >> 2);
+    h ^= (uint64_t)key->type + 0x94D049BB133111EBULL + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static int jobEqual (const jobKey *a, const jobKey *b) {
+    return a->tagId == b->tagId && a->ts == b->ts && a->type == b->type;
+}
+
+/**
+ * \brief Find the slot of a key, or the empty slot where it would go
+ * @param set The set
+ * @param key The key
+ * @return The slot index
+ */
+static size_t jobSlot (const jobSet *set, const jobKey *key) {
+    size_t mask = set->capacity - 1;
+    size_t i = jobHash(key) & mask;
+    while (set->used[i] && !jobEqual(&set->slots[i], key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int jobSetGrow (jobSet *set) {
+    jobSet bigger;
+    size_t i;
+    bigger.capacity = set->capacity ? set->capacity * 2 : JOBSET_MIN_CAPACITY;
+    bigger.count = set->count;
+    bigger.slots = malloc(bigger.capacity * sizeof (jobKey));
+    bigger.used = calloc(bigger.capacity, 1);
+    if (bigger.slots == NULL || bigger.used == NULL) {
+        free(bigger.slots);
+        free(bigger.used);
+        return -1;
+    }
+    for (i = 0; i < set->capacity; i++) {
+        if (set->used[i]) {
+            size_t j = jobSlot(&bigger, &set->slots[i]);
+            bigger.slots[j] = set->slots[i];
+            bigger.used[j] = 1;
+        }
+    }
+    jobSetFree(set);
+    *set = bigger;
+    return 0;
+}
+
+/**
+ * \brief Add a job to the set
+ * @param set The set
+ * @param key The job
+ * @return 1 if it was added, 0 if it was already there, -1 out of memory
+ */
+int jobSetAdd (jobSet *set, const jobKey *key) {
+    if ((set->count + 1) * 4 > set->capacity * 3 && jobSetGrow(set) != 0) {
+        return -1;
+    }
+    size_t i = jobSlot(set, key);
+    if (set->used[i]) {
+        return 0;
+    }
+    set->slots[i] = *key;
+    set->used[i] = 1;
+    set->count++;
+    return 1;
+}
+
+/**
+ * \brief Remove a job from the set, if there
+ *        Following entries of the probe chain are shifted back so lookups
+ *        never need tombstones
+ * @param set The set
+ * @param key The job
+ */
+void jobSetRemove (jobSet *set, const jobKey *key) {
+    if (set->count == 0) {
+        return;
+    }
+    size_t mask = set->capacity - 1;
+    size_t i = jobSlot(set, key);
+    if (!set->used[i]) {
+        return;
+    }
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!set->used[j]) {
+            break;
+        }
+        size_t home = jobHash(&set->slots[j]) & mask;
+        // move j back to i unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->used[i] = 0;
+    set->count--;
+}
+
+void jobSetClear (jobSet *set) {
+    if (set->used != NULL) {
+        memset(set->used, 0, set->capacity);
+    }
+    set->count = 0;
+}
+
+void jobSetFree (jobSet *set) {
+    free(set->slots);
+    free(set->used);
+    memset(set, 0, sizeof (*set));
+}
@@ -0,0 +1,415 @@
+/*
+ * Vectorized sample aggregation
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "kernel.h"
+#include "calendar.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Per lane partial results. Every kernel fills them for the first
+ * count - count % KERNEL_LANES samples, the rest goes through laneTail
+ */
+typedef struct kernelLanes {
+    double sum[KERNEL_LANES];
+    double min[KERNEL_LANES];
+    double max[KERNEL_LANES];
+    int64_t count;
+} kernelLanes;
+
+typedef struct kernelImpl {
+    const char *name;
+    int (*supported) (void);
+    int (*sums) (const double *values, int count, kernelLanes *l);
+    int (*squares) (const double *values, int count, double mean, double *m2);
+} kernelImpl;
+
+/*
+ * The one place the lanes are combined, shared by all kernels. min and max
+ * keep the first operand unless the second is below, or above, as
+ * minpd and maxpd do
+ */
+#define LANE_MIN(a, b)  ((a) < (b) ? (a) : (b))
+#define LANE_MAX(a, b)  ((a) > (b) ? (a) : (b))
+
+static double laneSum (const double *s) {
+    return ((s[0] + s[4]) + (s[2] + s[6])) + ((s[1] + s[5]) + (s[3] + s[7]));
+}
+
+static double laneMin (const double *s) {
+    double a = LANE_MIN(LANE_MIN(s[0], s[4]), LANE_MIN(s[2], s[6]));
+    double b = LANE_MIN(LANE_MIN(s[1], s[5]), LANE_MIN(s[3], s[7]));
+    return LANE_MIN(a, b);
+}
+
+static double laneMax (const double *s) {
+    double a = LANE_MAX(LANE_MAX(s[0], s[4]), LANE_MAX(s[2], s[6]));
+    double b = LANE_MAX(LANE_MAX(s[1], s[5]), LANE_MAX(s[3], s[7]));
+    return LANE_MAX(a, b);
+}
+
+static void laneInit (kernelLanes *l) {
+    int j;
+    for (j = 0; j < KERNEL_LANES; j++) {
+        l->sum[j] = 0;
+        l->min[j] = INFINITY;
+        l->max[j] = -INFINITY;
+    }
+    l->count = 0;
+}
+
+/**
+ * \brief Fold samples into the lanes one at a time, the way a vector
+ *        kernel does it: a missing sample adds 0 and counts as +inf for
+ *        the minimum and -inf for the maximum
+ * @param values The samples, values[j] goes to lane j
+ * @param count How many, at most KERNEL_LANES
+ * @param l The lanes
+ */
+static void laneTail (const double *values, int count, kernelLanes *l) {
+    int j;
+    for (j = 0; j < count; j++) {
+        double x = values[j];
+        int ok = x == x;
+        l->sum[j] += ok ? x : 0.0;
+        l->min[j] = LANE_MIN(l->min[j], ok ? x : INFINITY);
+        l->max[j] = LANE_MAX(l->max[j], ok ? x : -INFINITY);
+        l->count += ok;
+    }
+}
+
+static void laneTailSquares (const double *values, int count, double mean, double *m2) {
+    int j;
+    for (j = 0; j < count; j++) {
+        double d = values[j] == values[j] ? values[j] - mean : 0.0;
+        m2[j] += d * d;
+    }
+}
+
+static int scalarSupported (void) {
+    return 1;
+}
+
+static int scalarSums (const double *values, int count, kernelLanes *l) {
+    int i;
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        laneTail(values + i, KERNEL_LANES, l);
+    }
+    return i;
+}
+
+static int scalarSquares (const double *values, int count, double mean, double *m2) {
+    int i;
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        laneTailSquares(values + i, KERNEL_LANES, mean, m2);
+    }
+    return i;
+}
+
+#ifdef KERNEL_X86
+
+static int sse2Supported (void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+/*
+ * Four registers of two lanes: lanes 0-1, 2-3, 4-5 and 6-7
+ */
+__attribute__((target("sse2")))
+static int sse2Sums (const double *values, int count, kernelLanes *l) {
+    __m128d sum[4], min[4], max[4];
+    __m128i n = _mm_setzero_si128();
+    const __m128d inf = _mm_set1_pd(INFINITY);
+    const __m128d ninf = _mm_set1_pd(-INFINITY);
+    int i, r;
+    for (r = 0; r < 4; r++) {
+        sum[r] = _mm_setzero_pd();
+        min[r] = inf;
+        max[r] = ninf;
+    }
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (r = 0; r < 4; r++) {
+            __m128d x = _mm_loadu_pd(values + i + 2 * r);
+            __m128d ok = _mm_cmpord_pd(x, x);
+            sum[r] = _mm_add_pd(sum[r], _mm_and_pd(ok, x));
+            min[r] = _mm_min_pd(min[r], _mm_or_pd(_mm_and_pd(ok, x), _mm_andnot_pd(ok, inf)));
+            max[r] = _mm_max_pd(max[r], _mm_or_pd(_mm_and_pd(ok, x), _mm_andnot_pd(ok, ninf)));
+            n = _mm_sub_epi64(n, _mm_castpd_si128(ok));     // all ones is -1
+        }
+    }
+    for (r = 0; r < 4; r++) {
+        _mm_storeu_pd(l->sum + 2 * r, sum[r]);
+        _mm_storeu_pd(l->min + 2 * r, min[r]);
+        _mm_storeu_pd(l->max + 2 * r, max[r]);
+    }
+    int64_t c[2];
+    _mm_storeu_si128((__m128i *)c, n);
+    l->count += c[0] + c[1];
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int sse2Squares (const double *values, int count, double mean, double *m2) {
+    __m128d acc[4];
+    const __m128d m = _mm_set1_pd(mean);
+    int i, r;
+    for (r = 0; r < 4; r++) {
+        acc[r] = _mm_setzero_pd();
+    }
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (r = 0; r < 4; r++) {
+            __m128d x = _mm_loadu_pd(values + i + 2 * r);
+            __m128d d = _mm_and_pd(_mm_cmpord_pd(x, x), _mm_sub_pd(x, m));
+            acc[r] = _mm_add_pd(acc[r], _mm_mul_pd(d, d));
+        }
+    }
+    for (r = 0; r < 4; r++) {
+        _mm_storeu_pd(m2 + 2 * r, acc[r]);
+    }
+    return i;
+}
+
+static int avx2Supported (void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * Two registers of four lanes: lanes 0-3 and 4-7
+ */
+__attribute__((target("avx2")))
+static int avx2Sums (const double *values, int count, kernelLanes *l) {
+    __m256d sum[2], min[2], max[2];
+    __m256i n = _mm256_setzero_si256();
+    const __m256d inf = _mm256_set1_pd(INFINITY);
+    const __m256d ninf = _mm256_set1_pd(-INFINITY);
+    int i, r;
+    for (r = 0; r < 2; r++) {
+        sum[r] = _mm256_setzero_pd();
+        min[r] = inf;
+        max[r] = ninf;
+    }
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (r = 0; r < 2; r++) {
+            __m256d x = _mm256_loadu_pd(values + i + 4 * r);
+            __m256d ok = _mm256_cmp_pd(x, x, _CMP_ORD_Q);
+            sum[r] = _mm256_add_pd(sum[r], _mm256_and_pd(ok, x));
+            min[r] = _mm256_min_pd(min[r], _mm256_blendv_pd(inf, x, ok));
+            max[r] = _mm256_max_pd(max[r], _mm256_blendv_pd(ninf, x, ok));
+            n = _mm256_sub_epi64(n, _mm256_castpd_si256(ok));
+        }
+    }
+    for (r = 0; r < 2; r++) {
+        _mm256_storeu_pd(l->sum + 4 * r, sum[r]);
+        _mm256_storeu_pd(l->min + 4 * r, min[r]);
+        _mm256_storeu_pd(l->max + 4 * r, max[r]);
+    }
+    int64_t c[4];
+    _mm256_storeu_si256((__m256i *)c, n);
+    l->count += c[0] + c[1] + c[2] + c[3];
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int avx2Squares (const double *values, int count, double mean, double *m2) {
+    __m256d acc[2];
+    const __m256d m = _mm256_set1_pd(mean);
+    int i, r;
+    for (r = 0; r < 2; r++) {
+        acc[r] = _mm256_setzero_pd();
+    }
+    for (i = 0; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (r = 0; r < 2; r++) {
+            __m256d x = _mm256_loadu_pd(values + i + 4 * r);
+            __m256d d = _mm256_and_pd(_mm256_cmp_pd(x, x, _CMP_ORD_Q), _mm256_sub_pd(x, m));
+            acc[r] = _mm256_add_pd(acc[r], _mm256_mul_pd(d, d));
+        }
+    }
+    for (r = 0; r < 2; r++) {
+        _mm256_storeu_pd(m2 + 4 * r, acc[r]);
+    }
+    return i;
+}
+
+#endif
+
+/* best first */
+static const kernelImpl kernels[] = {
+#ifdef KERNEL_X86
+    {"avx2",   avx2Supported,   avx2Sums,   avx2Squares},
+    {"sse2",   sse2Supported,   sse2Sums,   sse2Squares},
+#endif
+    {"scalar", scalarSupported, scalarSums, scalarSquares}
+};
+
+#define KERNEL_COUNT    ((int)(sizeof (kernels) / sizeof (kernels[0])))
+
+static const kernelImpl *active;
+static pthread_once_t activeOnce = PTHREAD_ONCE_INIT;
+
+static void kernelSelect (void) {
+    int k = 0;
+    while (!kernels[k].supported()) {
+        k++;
+    }
+    active = &kernels[k];
+}
+
+/**
+ * \brief Aggregate an array of samples with one kernel
+ * @param k The kernel
+ * @param values The samples, NaN for a missing one
+ * @param count How many
+ * @param agg The result
+ */
+static void kernelRun (const kernelImpl *k, const double *values, int count, kernelAgg *agg) {
+    kernelLanes l;
+    double m2[KERNEL_LANES] = {0};
+    laneInit(&l);
+    int i = count > 0 ? k->sums(values, count, &l) : 0;
+    laneTail(values + i, count - i, &l);
+    agg->count = l.count;
+    agg->sum = laneSum(l.sum);
+    agg->min = laneMin(l.min);
+    agg->max = laneMax(l.max);
+    agg->m2 = 0;
+    if (l.count > 1) {
+        double mean = agg->sum / l.count;
+        i = k->squares(values, count, mean, m2);
+        laneTailSquares(values + i, count - i, mean, m2);
+        agg->m2 = laneSum(m2);
+    }
+}
+
+/**
+ * \brief Aggregate an array of samples with the best kernel of the CPU
+ * @param values The samples, NaN for a missing one
+ * @param count How many
+ * @param agg The result
+ */
+void kernelAggregate (const double *values, int count, kernelAgg *agg) {
+    pthread_once(&activeOnce, kernelSelect);
+    kernelRun(active, values, count, agg);
+}
+
+/**
+ * \brief Name of the kernel kernelAggregate runs
+ * @return The name
+ */
+const char *kernelName (void) {
+    pthread_once(&activeOnce, kernelSelect);
+    return active->name;
+}
+
+/**
+ * \brief Aggregate one value at a time, as foldSample does without the
+ *        sketch. The reference the kernels are measured against
+ */
+static void kernelWelford (const double *values, int count, kernelAgg *agg) {
+    int i;
+    memset(agg, 0, sizeof (*agg));
+    agg->min = INFINITY;
+    agg->max = -INFINITY;
+    for (i = 0; i < count; i++) {
+        double x = values[i];
+        if (x != x) {
+            continue;
+        }
+        if (x > agg->max) {
+            agg->max = x;
+        }
+        if (x < agg->min) {
+            agg->min = x;
+        }
+        double before = agg->count > 0 ? x - agg->sum / agg->count : 0;
+        agg->sum += x;
+        agg->count++;
+        agg->m2 += before * (x - agg->sum / agg->count);
+    }
+}
+
+/**
+ * \brief Measure every kernel the CPU runs on one core, in GB of samples
+ *        per second, on an array that fits the L1 cache and on one of
+ *        count samples. One sample in a hundred is missing
+ * @param count Samples of the large array
+ */
+void kernelBench (int count) {
+    int sizes[2] = {4096, count > 0 ? count : 1};
+    double *values = malloc(sizes[1] > sizes[0] ? sizes[1] * sizeof (double) : sizes[0] * sizeof (double));
+    if (values == NULL) {
+        return;
+    }
+    uint64_t seed = 88172645463325252ULL;
+    int i, s, k;
+    for (i = 0; i < (sizes[1] > sizes[0] ? sizes[1] : sizes[0]); i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        values[i] = seed % 100 == 0 ? NAN : 20 + (double)(seed % 100000) / 1000;
+    }
+    printf ("Kernel in use: %s\n", kernelName());
+    for (s = 0; s < 2; s++) {
+        int n = sizes[s];
+        kernelAgg ref;
+        kernelRun(&kernels[KERNEL_COUNT - 1], values, n, &ref);
+        for (k = -1; k < KERNEL_COUNT; k++) {
+            if (k >= 0 && !kernels[k].supported()) {
+                continue;
+            }
+            kernelAgg agg;
+            int64_t reps = 0;
+            double start = monotonicSeconds(), elapsed;
+            do {
+                if (k < 0) {
+                    kernelWelford(values, n, &agg);
+                } else {
+                    kernelRun(&kernels[k], values, n, &agg);
+                }
+                reps++;
+            } while ((elapsed = monotonicSeconds() - start) < 0.25);
+            printf ("%-10s %9d samples %7.2f GB/s %8.2f Msamples/s", k < 0 ? "one-by-one" : kernels[k].name,
+                    n, reps * n * sizeof (double) / elapsed / 1e9, reps * n / elapsed / 1e6);
+            if (k >= 0) {
+                printf ("  %s", memcmp(&agg, &ref, sizeof (agg)) == 0 ? "same as scalar" : "DIFFERS from scalar");
+            }
+            printf ("\n");
+        }
+    }
+    free(values);
+}
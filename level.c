@@ -0,0 +1,275 @@
+/*
+ * The roll up hierarchy
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "calendar.h"
+#include "level.h"
+
+#define LEVELS_DEFAULT  "hour,day,month,year"
+
+/*
+ * Every level known, finest first. Levels in use keep this order
+ */
+static rollupLevel levels[ROLLUP_LEVELS] = {
+    {"minute",  ROLLUP_MINUTE,   60,        ALIGN_FIXED},
+    {"15min",   ROLLUP_MINUTE15, 900,       ALIGN_FIXED},
+    {"hour",    ROLLUP_HOUR,     3600,      ALIGN_FIXED},
+    {"day",     ROLLUP_DAY,      86400,     ALIGN_DAY},
+    {"week",    ROLLUP_WEEK,     604800,    ALIGN_WEEK},
+    {"month",   ROLLUP_MONTH,    2629746,   ALIGN_MONTH},
+    {"quarter", ROLLUP_QUARTER,  7889238,   ALIGN_QUARTER},
+    {"year",    ROLLUP_YEAR,     31556952,  ALIGN_YEAR}
+};
+
+static rollupLevel *byType[ROLLUP_LEVELS];
+static int order[ROLLUP_LEVELS];    // the types in use, finest first
+static int orderCount;
+
+/**
+ * \brief Check that the buckets of a level are made of whole buckets of
+ *        a finer one, so it can be folded from them
+ * @param fine The finer level
+ * @param coarse The coarser level
+ * @return Non zero if they are
+ */
+static int levelTiles (const rollupLevel *fine, const rollupLevel *coarse) {
+    if (fine->align == ALIGN_FIXED) {
+        return 86400 % fine->seconds == 0 &&
+               (coarse->align != ALIGN_FIXED || coarse->seconds % fine->seconds == 0);
+    }
+    if (fine->align == ALIGN_WEEK || coarse->align == ALIGN_WEEK) {
+        return fine->align == ALIGN_DAY;
+    }
+    return fine->align < coarse->align;
+}
+
+/**
+ * \brief Choose the levels in use and derive the cascade
+ *        Each level is folded from the coarsest finer level it is made of,
+ *        the finest one from the samples. The finest one must tile every
+ *        other, so each sample lands in exactly one bucket of every level
+ * @param names Comma separated level names, NULL for hour,day,month,year
+ * @return 0 if all good, SQLITE_MISUSE if the list does not make a hierarchy
+ */
+int levelConfigure (const char *names) {
+    char list[256];
+    char *name, *save;
+    int i, j;
+    if (names == NULL) {
+        names = LEVELS_DEFAULT;
+    }
+    for (i = 0; i < ROLLUP_LEVELS; i++) {
+        levels[i].enabled = 0;
+        levels[i].child = ROLLUP_RAW;
+        levels[i].parent = -1;
+        levels[i].parentCount = 0;
+        byType[levels[i].type] = &levels[i];
+    }
+    snprintf (list, sizeof (list), "%s", names);
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        int type;
+        if (levelByName(name, &type) != SQLITE_OK || type == ROLLUP_RAW) {
+            printf ("Unknown level %s\n", name);
+            return SQLITE_MISUSE;
+        }
+        byType[type]->enabled = 1;
+    }
+    orderCount = 0;
+    for (i = 0; i < ROLLUP_LEVELS; i++) {
+        if (levels[i].enabled) {
+            order[orderCount++] = levels[i].type;
+        }
+    }
+    if (orderCount == 0) {
+        printf ("No roll up level\n");
+        return SQLITE_MISUSE;
+    }
+    for (i = 1; i < orderCount; i++) {
+        rollupLevel *l = byType[order[i]];
+        if (!levelTiles(byType[order[0]], l)) {
+            printf ("A %s is not made of whole %s buckets\n", l->name, byType[order[0]]->name);
+            return SQLITE_MISUSE;
+        }
+        for (j = i - 1; j >= 0 && !levelTiles(byType[order[j]], l); j--) {
+        }
+        l->child = order[j];
+        rollupLevel *c = byType[l->child];
+        c->parents[c->parentCount++] = l->type;
+    }
+    // the path down from the coarsest level is what a query walks
+    int type = order[orderCount - 1];
+    while (byType[type]->child != ROLLUP_RAW) {
+        byType[byType[type]->child]->parent = type;
+        type = byType[type]->child;
+    }
+    for (i = 0; i < orderCount; i++) {
+        rollupLevel *l = byType[order[i]];
+        if (l->parent < 0 && l->parentCount > 0) {
+            l->parent = l->parents[0];
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Configure the default levels if nobody did
+ */
+static void levelEnsure (void) {
+    if (orderCount == 0) {
+        levelConfigure(NULL);
+    }
+}
+
+/**
+ * \brief Look up a level in use
+ * @param type The level. See enAggregationType
+ * @return The level, NULL if not in use
+ */
+const rollupLevel *levelGet (int type) {
+    levelEnsure();
+    if (type < 0 || type >= ROLLUP_LEVELS || !byType[type]->enabled) {
+        return NULL;
+    }
+    return byType[type];
+}
+
+int levelCount (void) {
+    levelEnsure();
+    return orderCount;
+}
+
+/**
+ * \brief A level in use by position, finest first
+ * @param i The position, 0 to levelCount() - 1
+ * @return The level. See enAggregationType
+ */
+int levelAt (int i) {
+    levelEnsure();
+    return order[i];
+}
+
+/**
+ * \brief Look up a level by name, raw included
+ * @param name The name
+ * @param type The level. See enAggregationType
+ * @return 0 if all good, SQLITE_NOTFOUND if unknown
+ */
+int levelByName (const char *name, int *type) {
+    int i;
+    if (strcmp(name, "raw") == 0) {
+        *type = ROLLUP_RAW;
+        return SQLITE_OK;
+    }
+    for (i = 0; i < ROLLUP_LEVELS; i++) {
+        if (strcmp(name, levels[i].name) == 0) {
+            *type = levels[i].type;
+            return SQLITE_OK;
+        }
+    }
+    return SQLITE_NOTFOUND;
+}
+
+/**
+ * \brief The levels in use as levelConfigure takes them, finest first
+ * @param list Filled
+ * @param size Its size
+ */
+void levelList (char *list, int size) {
+    int i, n = 0;
+    levelEnsure();
+    list[0] = '\0';
+    for (i = 0; i < orderCount && n < size; i++) {
+        n += snprintf (list + n, size - n, "%s%s", i > 0 ? "," : "", byType[order[i]]->name);
+    }
+}
+
+const char *levelName (int type) {
+    if (type == ROLLUP_RAW) {
+        return "raw";
+    }
+    levelEnsure();
+    return type >= 0 && type < ROLLUP_LEVELS ? byType[type]->name : "?";
+}
+
+/**
+ * \brief Start of the bucket of a level holding a time stamp
+ * @param type The level. See enAggregationType
+ * @param ts The time stamp
+ * @return The bucket start
+ */
+int64_t bucketStart (int type, int64_t ts) {
+    levelEnsure();
+    const rollupLevel *l = byType[type];
+    switch (l->align) {
+        case ALIGN_FIXED:
+            return getStartOfInterval(ts, l->seconds);
+        case ALIGN_DAY:
+            return getStartOfDay(ts);
+        case ALIGN_WEEK:
+            return getStartOfWeek(ts);
+        case ALIGN_MONTH:
+            return getStartOfMonth(ts);
+        case ALIGN_QUARTER:
+            return getStartOfQuarter(ts);
+        default:
+            return getStartOfYear(ts);
+    }
+}
+
+/**
+ * \brief Start of the bucket after the given one
+ * @param type The level. See enAggregationType
+ * @param start The bucket start
+ * @return The next bucket start
+ */
+int64_t bucketNext (int type, int64_t start) {
+    levelEnsure();
+    const rollupLevel *l = byType[type];
+    switch (l->align) {
+        case ALIGN_FIXED:
+            return start + l->seconds;
+        case ALIGN_DAY:
+            return getStartOfDay(timeAddDay(start));
+        case ALIGN_WEEK:
+            // half a day past seven days is in the next week whatever the DST
+            return getStartOfWeek(start + 7 * 86400 + 43200);
+        case ALIGN_MONTH:
+            return getStartOfMonth(timeAddMonth(start));
+        case ALIGN_QUARTER:
+            // a quarter is 90 to 92 days long
+            return getStartOfQuarter(start + 95 * 86400);
+        default:
+            return getStartOfYear(timeAddYear(start));
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * The roll up hierarchy
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <stdint.h>
+
+/*
+ * The roll up levels. The values are stored in Rollup.Type and Job.Type,
+ * so a new level takes the next free one whatever its place in the
+ * hierarchy
+ */
+typedef enum {
+    ROLLUP_RAW = -1,        // the samples themselves
+    ROLLUP_HOUR = 0,
+    ROLLUP_DAY,
+    ROLLUP_MONTH,
+    ROLLUP_YEAR,
+    ROLLUP_MINUTE,
+    ROLLUP_MINUTE15,
+    ROLLUP_WEEK,
+    ROLLUP_QUARTER,
+    ROLLUP_LEVELS
+} enAggregationType;
+
+/*
+ * Where the buckets of a level start
+ */
+typedef enum {
+    ALIGN_FIXED = 0,        // every seconds, from the local midnight
+    ALIGN_DAY,
+    ALIGN_WEEK,             // ISO week, from Monday
+    ALIGN_MONTH,
+    ALIGN_QUARTER,
+    ALIGN_YEAR
+} enAlignment;
+
+/*
+ * One row of the level table. A bucket starting at b holds the samples in
+ * (b, next b]. The last four fields follow from the levels in use, see
+ * levelConfigure
+ */
+typedef struct rollupLevel {
+    const char *name;
+    int type;               // See enAggregationType
+    int seconds;            // bucket length, the average one for calendar levels
+    int align;              // See enAlignment
+    int enabled;
+    int child;              // the level folded into this one, ROLLUP_RAW for the samples
+    int parent;             // the level this one is folded into on the way to the top, -1 if none
+    int parents[ROLLUP_LEVELS];     // every level folded from this one
+    int parentCount;
+} rollupLevel;
+
+int levelConfigure (const char *names);
+const rollupLevel *levelGet (int type);
+int levelCount (void);
+int levelAt (int i);
+int levelByName (const char *name, int *type);
+void levelList (char *list, int size);
+const char *levelName (int type);
+int64_t bucketStart (int type, int64_t ts);
+int64_t bucketNext (int type, int64_t start);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * In-memory storage backend
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "rollup.h"
+#include "store.h"
+
+/*
+ * A stored bucket. The sketch is kept serialized, the way the roll up table
+ * keeps it, so a read costs what it costs on SQLite minus the storage
+ */
+typedef struct memBucket {
+    double vsum;
+    double vmax;
+    double vmin;
+    double vm2;
+    int64_t vcount;
+    int sketchBytes;
+    unsigned char sketch[];
+} memBucket;
+
+/*
+ * The buckets of one tag at one level, sorted by start
+ */
+typedef struct memLevel {
+    int64_t *ts;
+    memBucket **b;
+    int count;
+    int capacity;
+} memLevel;
+
+/*
+ * Everything stored for one tag
+ */
+typedef struct memTag {
+    int64_t tagId;
+    int64_t *ts;            // raw samples, sorted by time stamp
+    double *value;
+    int samples;
+    int sampleCapacity;
+    memLevel level[ROLLUP_LEVELS];
+    int64_t mark[ROLLUP_LEVELS];    // watermarks, valid where marked is set
+    unsigned char marked[ROLLUP_LEVELS];
+} memTag;
+
+typedef struct memJob {
+    jobKey key;
+    int live;
+} memJob;
+
+/*
+ * The job queue of one level
+ */
+typedef struct memQueue {
+    memJob *jobs;
+    int count;
+    int capacity;
+} memQueue;
+
+/*
+ * Plain arrays in the process heap. Nothing is durable, transactions are
+ * accepted but a rollback keeps what was written
+ */
+typedef struct memStore {
+    rollupStore base;
+    memTag **tags;          // sorted by tag ID
+    int tagCount;
+    int tagCapacity;
+    memTag *last;           // the tag of the last lookup
+    memQueue queue[ROLLUP_LEVELS];
+    jobSet queued;
+    int scanType;           // level of the open job cursor, -1 if none
+    int scanEnd;
+    int scanPos;
+    int transaction;
+} memStore;
+
+/**
+ * \brief Grow an array to hold at least one more item
+ * @param items The array
+ * @param capacity Its capacity, updated
+ * @param count Items in use
+ * @param size Size of one item
+ * @return 0 if all good
+ */
+static int memReserve (void **items, int *capacity, int count, size_t size) {
+    if (count < *capacity) {
+        return SQLITE_OK;
+    }
+    int n = *capacity ? *capacity * 2 : 64;
+    void *p = realloc(*items, n * size);
+    if (p == NULL) {
+        return SQLITE_NOMEM;
+    }
+    *items = p;
+    *capacity = n;
+    return SQLITE_OK;
+}
+
+/**
+ * \brief First index whose time stamp is greater than ts, or not less
+ *        than ts when equal is 0
+ * @param ts The sorted time stamps
+ * @param count How many
+ * @param key The time stamp to look for
+ * @param after Non zero to skip the time stamps equal to key
+ * @return The index, count if there is none
+ */
+static int memBound (const int64_t *ts, int count, int64_t key, int after) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ts[mid] < key || (after && ts[mid] == key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * \brief Find a tag, optionally adding it
+ * @param m The store
+ * @param tagId The tag ID
+ * @param create Non zero to add a missing tag
+ * @return The tag, NULL if missing or out of memory
+ */
+static memTag *memTagFind (memStore *m, int64_t tagId, int create) {
+    if (m->last != NULL && m->last->tagId == tagId) {
+        return m->last;
+    }
+    int lo = 0, hi = m->tagCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->tags[mid]->tagId < tagId) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < m->tagCount && m->tags[lo]->tagId == tagId) {
+        return m->last = m->tags[lo];
+    }
+    if (!create || memReserve((void **)&m->tags, &m->tagCapacity, m->tagCount, sizeof (memTag *)) != SQLITE_OK) {
+        return NULL;
+    }
+    memTag *t = calloc(1, sizeof (memTag));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->tagId = tagId;
+    memmove(&m->tags[lo + 1], &m->tags[lo], (m->tagCount - lo) * sizeof (memTag *));
+    m->tags[lo] = t;
+    m->tagCount++;
+    return m->last = t;
+}
+
+static int memBegin (rollupStore *s) {
+    ((memStore *)s)->transaction = 1;
+    return SQLITE_OK;
+}
+
+static int memCommit (rollupStore *s) {
+    ((memStore *)s)->transaction = 0;
+    return SQLITE_OK;
+}
+
+static int memAutocommit (rollupStore *s) {
+    return !((memStore *)s)->transaction;
+}
+
+/**
+ * \brief Add raw samples. Samples after the last one of their tag are
+ *        appended, late ones are moved into place
+ * @param s The store
+ * @param in The samples, in any order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+static int memInsertSamples (rollupStore *s, const rollupSample *in, int count) {
+    memStore *m = (memStore *)s;
+    int i;
+    for (i = 0; i < count; i++) {
+        memTag *t = memTagFind(m, in[i].tagId, 1);
+        if (t == NULL) {
+            return SQLITE_NOMEM;
+        }
+        if (t->samples == t->sampleCapacity) {
+            int n = t->sampleCapacity ? t->sampleCapacity * 2 : 1024;
+            int64_t *ts = realloc(t->ts, n * sizeof (int64_t));
+            if (ts == NULL) {
+                return SQLITE_NOMEM;
+            }
+            t->ts = ts;
+            double *value = realloc(t->value, n * sizeof (double));
+            if (value == NULL) {
+                return SQLITE_NOMEM;
+            }
+            t->value = value;
+            t->sampleCapacity = n;
+        }
+        int at = t->samples;
+        if (at > 0 && t->ts[at - 1] > in[i].ts) {
+            at = memBound(t->ts, t->samples, in[i].ts, 1);
+            memmove(&t->ts[at + 1], &t->ts[at], (t->samples - at) * sizeof (int64_t));
+            memmove(&t->value[at + 1], &t->value[at], (t->samples - at) * sizeof (double));
+        }
+        t->ts[at] = in[i].ts;
+        t->value[at] = in[i].value;
+        t->samples++;
+    }
+    return SQLITE_OK;
+}
+
+static int memScanSamples (rollupStore *s, int64_t tagId, int64_t from, int64_t to, storeSampleFn fn, void *arg) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    if (t != NULL) {
+        int i;
+        for (i = memBound(t->ts, t->samples, from, 1); i < t->samples && t->ts[i] <= to; i++) {
+            fn(arg, t->ts[i], t->value[i]);
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Unpack a stored bucket
+ * @param mb The stored bucket
+ * @param b The bucket
+ */
+static void memUnpack (const memBucket *mb, rollupBucket *b) {
+    memset(b, 0, sizeof (*b));
+    b->vsum = mb->vsum;
+    b->vmax = mb->vmax;
+    b->vmin = mb->vmin;
+    b->vm2 = mb->vm2;
+    b->vcount = mb->vcount;
+    tdigestDeserialize(&b->sketch, mb->sketch, mb->sketchBytes);
+}
+
+static int memScanBuckets (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, storeBucketFn fn, void *arg) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    if (t != NULL) {
+        memLevel *l = &t->level[type];
+        int i;
+        for (i = memBound(l->ts, l->count, from, 0); i < l->count && l->ts[i] < to; i++) {
+            rollupBucket b;
+            memUnpack(l->b[i], &b);
+            fn(arg, l->ts[i], &b);
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Fold a range of one level into a bucket
+ *        The samples are folded where they lie, the array being already
+ *        in the order the other stores hand them over
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples in (from, to]
+ * @param from First bucket start
+ * @param to Buckets starting before this time stamp
+ * @param b The bucket, zeroed by the caller
+ * @param rows How many rows were read
+ * @return 0 if all good
+ */
+static int memAggregate (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, rollupBucket *b, int64_t *rows) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    int i;
+    *rows = 0;
+    if (t == NULL) {
+        return SQLITE_OK;
+    }
+    if (type == ROLLUP_RAW) {
+        int first = memBound(t->ts, t->samples, from, 1);
+        int end = memBound(t->ts, t->samples, to, 1);
+        foldValues(b, t->value + first, end - first);
+        *rows = end - first;
+    } else {
+        memLevel *l = &t->level[type];
+        for (i = memBound(l->ts, l->count, from, 0); i < l->count && l->ts[i] < to; i++) {
+            rollupBucket child;
+            memUnpack(l->b[i], &child);
+            foldBucket(b, &child);
+            (*rows)++;
+        }
+    }
+    return SQLITE_OK;
+}
+
+static int memReadBucket (rollupStore *s, int64_t tagId, int type, int64_t ts, rollupBucket *b) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    memset(b, 0, sizeof (*b));
+    if (t != NULL) {
+        memLevel *l = &t->level[type];
+        int i = memBound(l->ts, l->count, ts, 0);
+        if (i < l->count && l->ts[i] == ts) {
+            memUnpack(l->b[i], b);
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Store a bucket, replacing the one with the same start
+ *        As on SQLite, a sketch short of some samples is not kept
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level. See enAggregationType
+ * @param ts The bucket start
+ * @param b The bucket
+ * @return 0 if all good
+ */
+static int memWriteBucket (rollupStore *s, int64_t tagId, int type, int64_t ts, const rollupBucket *b) {
+    memTag *t = memTagFind((memStore *)s, tagId, 1);
+    if (t == NULL) {
+        return SQLITE_NOMEM;
+    }
+    unsigned char sketch[TDIGEST_BLOB_MAX];
+    int sketchBytes = b->sketch.weight == b->vcount ? tdigestSerialize(&b->sketch, sketch) : 0;
+    memBucket *mb = malloc(sizeof (memBucket) + sketchBytes);
+    if (mb == NULL) {
+        return SQLITE_NOMEM;
+    }
+    mb->vsum = b->vsum;
+    mb->vmax = b->vmax;
+    mb->vmin = b->vmin;
+    mb->vm2 = b->vm2;
+    mb->vcount = b->vcount;
+    mb->sketchBytes = sketchBytes;
+    memcpy(mb->sketch, sketch, sketchBytes);
+    memLevel *l = &t->level[type];
+    int i = memBound(l->ts, l->count, ts, 0);
+    if (i < l->count && l->ts[i] == ts) {
+        free(l->b[i]);
+        l->b[i] = mb;
+        return SQLITE_OK;
+    }
+    int capacity = l->capacity;
+    if (memReserve((void **)&l->ts, &capacity, l->count, sizeof (int64_t)) != SQLITE_OK ||
+        memReserve((void **)&l->b, &l->capacity, l->count, sizeof (memBucket *)) != SQLITE_OK) {
+        free(mb);
+        return SQLITE_NOMEM;
+    }
+    memmove(&l->ts[i + 1], &l->ts[i], (l->count - i) * sizeof (int64_t));
+    memmove(&l->b[i + 1], &l->b[i], (l->count - i) * sizeof (memBucket *));
+    l->ts[i] = ts;
+    l->b[i] = mb;
+    l->count++;
+    return SQLITE_OK;
+}
+
+static int memJobInsert (rollupStore *s, const jobKey *key) {
+    memStore *m = (memStore *)s;
+    memQueue *q = &m->queue[key->type];
+    if (memReserve((void **)&q->jobs, &q->capacity, q->count, sizeof (memJob)) != SQLITE_OK) {
+        return SQLITE_NOMEM;
+    }
+    int rc = jobSetAdd(&m->queued, key);
+    if (rc < 0) {
+        return SQLITE_NOMEM;
+    }
+    if (rc == 0) {
+        return SQLITE_CONSTRAINT;
+    }
+    q->jobs[q->count].key = *key;
+    q->jobs[q->count].live = 1;
+    q->count++;
+    return SQLITE_OK;
+}
+
+static int memJobCompare (const void *a, const void *b) {
+    const jobKey *x = &((const memJob *)a)->key;
+    const jobKey *y = &((const memJob *)b)->key;
+    if (x->tagId != y->tagId) {
+        return x->tagId < y->tagId ? -1 : 1;
+    }
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+/**
+ * \brief Open the cursor over the jobs of one level, in (tag, ts) order
+ *        Job IDs are positions in the queue of that level, valid until
+ *        xJobEnd
+ * @param s The store
+ * @param type The level. See enAggregationType
+ * @return 0 if all good
+ */
+static int memJobBegin (rollupStore *s, int type) {
+    memStore *m = (memStore *)s;
+    memQueue *q = &m->queue[type];
+    qsort(q->jobs, q->count, sizeof (memJob), memJobCompare);
+    m->scanType = type;
+    m->scanEnd = q->count;
+    m->scanPos = 0;
+    return SQLITE_OK;
+}
+
+static int memJobNext (rollupStore *s, storeJob *job) {
+    memStore *m = (memStore *)s;
+    memQueue *q = &m->queue[m->scanType];
+    while (m->scanPos < m->scanEnd && !q->jobs[m->scanPos].live) {
+        m->scanPos++;
+    }
+    if (m->scanPos == m->scanEnd) {
+        return SQLITE_DONE;
+    }
+    job->id = m->scanPos;
+    job->tagId = q->jobs[m->scanPos].key.tagId;
+    job->ts = q->jobs[m->scanPos].key.ts;
+    m->scanPos++;
+    return SQLITE_ROW;
+}
+
+/**
+ * \brief Close the job cursor and drop the deleted jobs from the queue
+ * @param s The store
+ */
+static void memJobEnd (rollupStore *s) {
+    memStore *m = (memStore *)s;
+    if (m->scanType < 0) {
+        return;
+    }
+    memQueue *q = &m->queue[m->scanType];
+    int i, n = 0;
+    for (i = 0; i < q->count; i++) {
+        if (q->jobs[i].live) {
+            q->jobs[n++] = q->jobs[i];
+        }
+    }
+    q->count = n;
+    m->scanType = -1;
+}
+
+static int memJobDelete (rollupStore *s, int64_t id) {
+    memStore *m = (memStore *)s;
+    if (m->scanType < 0 || id < 0 || id >= m->scanEnd) {
+        return SQLITE_MISUSE;
+    }
+    memJob *job = &m->queue[m->scanType].jobs[id];
+    if (job->live) {
+        job->live = 0;
+        jobSetRemove(&m->queued, &job->key);
+    }
+    return SQLITE_OK;
+}
+
+static int memJobCount (rollupStore *s, int type, int64_t *count) {
+    memQueue *q = &((memStore *)s)->queue[type];
+    int i;
+    *count = 0;
+    for (i = 0; i < q->count; i++) {
+        *count += q->jobs[i].live;
+    }
+    return SQLITE_OK;
+}
+
+static int memJobOldest (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    memQueue *q = &((memStore *)s)->queue[type];
+    int i, found = 0;
+    for (i = 0; i < q->count; i++) {
+        if (q->jobs[i].live && (tagId == 0 || q->jobs[i].key.tagId == tagId) && (!found || q->jobs[i].key.ts < *ts)) {
+            *ts = q->jobs[i].key.ts;
+            found = 1;
+        }
+    }
+    return found ? SQLITE_OK : SQLITE_DONE;
+}
+
+static int memOldest (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    if (t == NULL) {
+        return SQLITE_DONE;
+    }
+    if (type == ROLLUP_RAW) {
+        if (t->samples == 0) {
+            return SQLITE_DONE;
+        }
+        *ts = t->ts[0];
+    } else {
+        if (t->level[type].count == 0) {
+            return SQLITE_DONE;
+        }
+        *ts = t->level[type].ts[0];
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Drop the head of the sorted arrays: the samples up to end, or the
+ *        buckets that start before end
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param end The first bucket start to keep
+ * @param deleted Items dropped
+ * @return 0 if all good
+ */
+static int memPurge (rollupStore *s, int64_t tagId, int type, int64_t end, int64_t *deleted) {
+    memTag *t = memTagFind((memStore *)s, tagId, 0);
+    int n, i;
+    *deleted = 0;
+    if (t == NULL) {
+        return SQLITE_OK;
+    }
+    if (type == ROLLUP_RAW) {
+        n = memBound(t->ts, t->samples, end, 1);
+        memmove(t->ts, t->ts + n, (t->samples - n) * sizeof (int64_t));
+        memmove(t->value, t->value + n, (t->samples - n) * sizeof (double));
+        t->samples -= n;
+    } else {
+        memLevel *l = &t->level[type];
+        n = memBound(l->ts, l->count, end, 0);
+        for (i = 0; i < n; i++) {
+            free(l->b[i]);
+        }
+        memmove(l->ts, l->ts + n, (l->count - n) * sizeof (int64_t));
+        memmove(l->b, l->b + n, (l->count - n) * sizeof (memBucket *));
+        l->count -= n;
+    }
+    *deleted = n;
+    return SQLITE_OK;
+}
+
+static int memListTags (rollupStore *s, storeTagFn fn, void *arg) {
+    memStore *m = (memStore *)s;
+    int i;
+    for (i = 0; i < m->tagCount; i++) {
+        fn(arg, m->tags[i]->tagId);
+    }
+    return SQLITE_OK;
+}
+
+static int memVacuum (rollupStore *s, int pages) {
+    (void)s;
+    (void)pages;
+    return SQLITE_OK;
+}
+
+static int memMarkGet (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    memStore *m = (memStore *)s;
+    int i, found = 0;
+    for (i = 0; i < m->tagCount; i++) {
+        memTag *t = m->tags[i];
+        if ((tagId == 0 || t->tagId == tagId) && t->marked[type] && (!found || t->mark[type] < *ts)) {
+            *ts = t->mark[type];
+            found = 1;
+        }
+    }
+    return found ? SQLITE_OK : SQLITE_DONE;
+}
+
+static int memMarkSet (rollupStore *s, int64_t tagId, int type, int64_t ts) {
+    memTag *t = memTagFind((memStore *)s, tagId, 1);
+    if (t == NULL) {
+        return SQLITE_NOMEM;
+    }
+    t->mark[type] = ts;
+    t->marked[type] = 1;
+    return SQLITE_OK;
+}
+
+static int memMarkScan (rollupStore *s, int type, storeMarkFn fn, void *arg) {
+    memStore *m = (memStore *)s;
+    int i;
+    for (i = 0; i < m->tagCount; i++) {
+        if (m->tags[i]->marked[type]) {
+            fn(arg, m->tags[i]->tagId, m->tags[i]->mark[type]);
+        }
+    }
+    return SQLITE_OK;
+}
+
+static void memReset (rollupStore *s) {
+    memStore *m = (memStore *)s;
+    const storeMethods *methods = s->methods;
+    int i, type, j;
+    for (i = 0; i < m->tagCount; i++) {
+        memTag *t = m->tags[i];
+        for (type = 0; type < ROLLUP_LEVELS; type++) {
+            for (j = 0; j < t->level[type].count; j++) {
+                free(t->level[type].b[j]);
+            }
+            free(t->level[type].ts);
+            free(t->level[type].b);
+        }
+        free(t->ts);
+        free(t->value);
+        free(t);
+    }
+    free(m->tags);
+    for (type = 0; type < ROLLUP_LEVELS; type++) {
+        free(m->queue[type].jobs);
+    }
+    jobSetFree(&m->queued);
+    memset(m, 0, sizeof (*m));
+    m->base.methods = methods;
+    m->scanType = -1;
+}
+
+static void memClose (rollupStore *s) {
+    memReset(s);
+    free(s);
+}
+
+static const storeMethods memMethods = {
+    "memory",
+    memBegin,
+    memCommit,
+    memCommit,      // nothing to roll back to
+    memAutocommit,
+    memInsertSamples,
+    memScanSamples,
+    memScanBuckets,
+    memAggregate,
+    memReadBucket,
+    memWriteBucket,
+    memJobInsert,
+    memJobBegin,
+    memJobNext,
+    memJobEnd,
+    memJobDelete,
+    memJobCount,
+    memJobOldest,
+    memOldest,
+    memPurge,
+    memListTags,
+    memVacuum,
+    memMarkGet,
+    memMarkSet,
+    memMarkScan,
+    memReset,
+    memClose
+};
+
+/**
+ * \brief Open an empty in-memory backend
+ *        It runs the same engine with no storage cost, so comparing it
+ *        with SQLite splits engine time from storage time
+ * @param ctx The connection context, unused
+ * @return The store or NULL if out of memory
+ */
+rollupStore *storeOpenMemory (rollupCtx *ctx) {
+    (void)ctx;
+    memStore *m = calloc(1, sizeof (memStore));
+    if (m != NULL) {
+        m->base.methods = &memMethods;
+        m->scanType = -1;
+    }
+    return (rollupStore *)m;
+}
@@ -0,0 +1,165 @@
+/*
+ * Roll up instrumentation
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <signal.h>
+#include <inttypes.h>
+#include "metrics.h"
+
+static const char *stageName[METRIC_STAGES] = {
+    "job fetch",
+    "read",
+    "write",
+    "job delete",
+    "enqueue",
+    "job flush",
+    "commit"
+};
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+/**
+ * \brief Account one latency sample of a stage
+ * @param m The metrics
+ * @param stage The stage. See enMetricStage
+ * @param ns The latency in nanoseconds
+ */
+void metricsRecord (rollupMetrics *m, int stage, int64_t ns) {
+    metricHistogram *h = &m->stage[stage];
+    int i = 63 - __builtin_clzll((uint64_t)ns | 1);
+    h->bucket[i < METRIC_BUCKETS ? i : METRIC_BUCKETS - 1]++;
+    h->count++;
+    h->totalNs += ns;
+    if (ns > h->maxNs) {
+        h->maxNs = ns;
+    }
+}
+
+/**
+ * \brief Add the metrics of another context, e.g. a roll up worker
+ * @param to The metrics to add to
+ * @param from The metrics to add
+ */
+void metricsMerge (rollupMetrics *to, const rollupMetrics *from) {
+    int i, j;
+    for (i = 0; i < METRIC_STAGES; i++) {
+        metricHistogram *h = &to->stage[i];
+        const metricHistogram *f = &from->stage[i];
+        h->count += f->count;
+        h->totalNs += f->totalNs;
+        if (f->maxNs > h->maxNs) {
+            h->maxNs = f->maxNs;
+        }
+        for (j = 0; j < METRIC_BUCKETS; j++) {
+            h->bucket[j] += f->bucket[j];
+        }
+    }
+    for (i = 0; i < METRIC_LEVELS; i++) {
+        to->rowsRead[i] += from->rowsRead[i];
+        to->rowsWritten[i] += from->rowsWritten[i];
+    }
+    to->constraintFallbacks += from->constraintFallbacks;
+    to->sqliteErrors += from->sqliteErrors;
+}
+
+/**
+ * \brief Upper bound of the bucket holding a quantile
+ * @param h The histogram
+ * @param q The quantile, 0 to 1
+ * @return The latency in nanoseconds
+ */
+static int64_t histogramQuantile (const metricHistogram *h, double q) {
+    int64_t rank = (int64_t)(q * h->count + 0.5);
+    int64_t seen = 0;
+    int i;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < METRIC_BUCKETS - 1; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            int64_t upper = (int64_t)1 << (i + 1);
+            return upper < h->maxNs ? upper : h->maxNs;
+        }
+    }
+    return h->maxNs;
+}
+
+/**
+ * \brief Print the counters and the latency of every stage
+ *        Quantiles are the upper bound of their power of two bucket
+ * @param m The metrics
+ * @param out Where to print
+ */
+void metricsDump (const rollupMetrics *m, FILE *out) {
+    int i;
+    fprintf (out, "%-10s %10s %10s %9s %9s %9s %9s %9s\n",
+             "stage", "count", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (i = 0; i < METRIC_STAGES; i++) {
+        const metricHistogram *h = &m->stage[i];
+        if (h->count == 0) {
+            continue;
+        }
+        fprintf (out, "%-10s %10" PRId64 " %10.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                 stageName[i], h->count, h->totalNs / 1e6, h->totalNs / 1e3 / h->count,
+                 histogramQuantile(h, 0.50) / 1e3, histogramQuantile(h, 0.90) / 1e3,
+                 histogramQuantile(h, 0.99) / 1e3, h->maxNs / 1e3);
+    }
+    for (i = 0; i < levelCount(); i++) {
+        int type = levelAt(i);
+        fprintf (out, "%-10s rows read %" PRId64 ", rows written %" PRId64 ", backlog %" PRId64 "\n",
+                 levelName(type), m->rowsRead[type], m->rowsWritten[type], m->backlog[type]);
+    }
+    fprintf (out, "Constraint fallbacks %" PRId64 ", SQLite errors %" PRId64 "\n",
+             m->constraintFallbacks, m->sqliteErrors);
+}
+
+static void dumpSignal (int sig) {
+    dumpRequested = 1;
+}
+
+/**
+ * \brief Dump the metrics on demand. After this a SIGUSR1 makes the next
+ *        metricsDumpPending() call return non zero
+ */
+void metricsInstall (void) {
+    signal(SIGUSR1, dumpSignal);
+}
+
+/**
+ * \brief Check for, and clear, a dump request
+ * @return Non zero if a dump was asked for since the last call
+ */
+int metricsDumpPending (void) {
+    if (dumpRequested) {
+        dumpRequested = 0;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Roll up instrumentation
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "level.h"
+
+/*
+ * Stages of a roll up job. Each one keeps a latency histogram with one
+ * bucket per power of two nanoseconds, so recording is a clock read, a
+ * count leading zeros and three adds.
+ */
+typedef enum {
+    METRIC_JOB_FETCH = 0,   // step of the job cursor
+    METRIC_READ,            // bucket SELECT on History or the level below
+    METRIC_WRITE,           // rollup upsert
+    METRIC_JOB_DELETE,
+    METRIC_ENQUEUE,         // next level job
+    METRIC_JOB_FLUSH,       // pending jobs written to the job table
+    METRIC_COMMIT,
+    METRIC_STAGES
+} enMetricStage;
+
+#define METRIC_BUCKETS  40  // bucket i holds [2^i, 2^(i+1)) ns, the last one is open
+#define METRIC_LEVELS   ROLLUP_LEVELS   // one per enAggregationType
+
+typedef struct metricHistogram {
+    int64_t count;
+    int64_t totalNs;
+    int64_t maxNs;
+    int64_t bucket[METRIC_BUCKETS];
+} metricHistogram;
+
+typedef struct rollupMetrics {
+    metricHistogram stage[METRIC_STAGES];
+    int64_t rowsRead[METRIC_LEVELS];
+    int64_t rowsWritten[METRIC_LEVELS];
+    int64_t backlog[METRIC_LEVELS];     // dirty buckets waiting, a gauge set by rollupBacklog
+    int64_t constraintFallbacks;    // two step upserts that went on to the UPDATE
+    int64_t sqliteErrors;
+} rollupMetrics;
+
+void metricsRecord (rollupMetrics *m, int stage, int64_t ns);
+void metricsMerge (rollupMetrics *to, const rollupMetrics *from);
+void metricsDump (const rollupMetrics *m, FILE *out);
+void metricsInstall (void);
+int metricsDumpPending (void);
+
+#endif
@@ -36,7 +36,27 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 # Object Files
 OBJECTFILES= \
 	${OBJECTDIR}/sqlite3.o \
-	${OBJECTDIR}/rollup.o
+	${OBJECTDIR}/rollup.o \
+	${OBJECTDIR}/calendar.o \
+	${OBJECTDIR}/parallel.o \
+	${OBJECTDIR}/jobset.o \
+	${OBJECTDIR}/ingest.o \
+	${OBJECTDIR}/bench.o \
+	${OBJECTDIR}/metrics.o \
+	${OBJECTDIR}/tdigest.o \
+	${OBJECTDIR}/block.o \
+	${OBJECTDIR}/store.o \
+	${OBJECTDIR}/memstore.o \
+	${OBJECTDIR}/query.o \
+	${OBJECTDIR}/dirtyrange.o \
+	${OBJECTDIR}/retention.o \
+	${OBJECTDIR}/level.o \
+	${OBJECTDIR}/daemon.o \
+	${OBJECTDIR}/watermark.o \
+	${OBJECTDIR}/kernel.o \
+	${OBJECTDIR}/aggregate.o \
+	${OBJECTDIR}/series.o \
+	${OBJECTDIR}/extension.o
 
 
 # C Compiler Flags
@@ -53,7 +73,7 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=-lpthread -ldl
+LDLIBSOPTIONS=-lpthread -ldl -lm
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
@@ -73,6 +93,106 @@ ${OBJECTDIR}/rollup.o: rollup.c
 	${RM} "$@.d"
 	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/rollup.o rollup.c
 
+${OBJECTDIR}/calendar.o: calendar.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/calendar.o calendar.c
+
+${OBJECTDIR}/parallel.o: parallel.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/parallel.o parallel.c
+
+${OBJECTDIR}/jobset.o: jobset.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/jobset.o jobset.c
+
+${OBJECTDIR}/ingest.o: ingest.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ingest.o ingest.c
+
+${OBJECTDIR}/bench.o: bench.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/bench.o bench.c
+
+${OBJECTDIR}/metrics.o: metrics.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/metrics.o metrics.c
+
+${OBJECTDIR}/tdigest.o: tdigest.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/tdigest.o tdigest.c
+
+${OBJECTDIR}/block.o: block.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/block.o block.c
+
+${OBJECTDIR}/store.o: store.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/store.o store.c
+
+${OBJECTDIR}/memstore.o: memstore.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/memstore.o memstore.c
+
+${OBJECTDIR}/query.o: query.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/query.o query.c
+
+${OBJECTDIR}/dirtyrange.o: dirtyrange.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/dirtyrange.o dirtyrange.c
+
+${OBJECTDIR}/retention.o: retention.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/retention.o retention.c
+
+${OBJECTDIR}/level.o: level.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/level.o level.c
+
+${OBJECTDIR}/daemon.o: daemon.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/daemon.o daemon.c
+
+${OBJECTDIR}/watermark.o: watermark.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/watermark.o watermark.c
+
+${OBJECTDIR}/kernel.o: kernel.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/kernel.o kernel.c
+
+${OBJECTDIR}/aggregate.o: aggregate.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/aggregate.o aggregate.c
+
+${OBJECTDIR}/series.o: series.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/series.o series.c
+
+${OBJECTDIR}/extension.o: extension.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.c) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/extension.o extension.c
+
 # Subprojects
 .build-subprojects:
 
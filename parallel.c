@@ -0,0 +1,265 @@
+/*
+ * Parallel roll up across tags
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+#define QUEUE_SIZE  1024    // an item carries its sketch, a few KB
+
+/*
+ * A computed job waiting for the writer
+ */
+typedef struct writeItem {
+    int64_t id;
+    int64_t tagId;
+    time_t start;
+    rollupBucket b;
+} writeItem;
+
+/*
+ * Bounded queue between the workers and the single writer
+ */
+typedef struct writeQueue {
+    writeItem items[QUEUE_SIZE];
+    int head;
+    int count;
+    int producers;          // workers still running
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} writeQueue;
+
+/*
+ * One worker. Reads the jobs of its share of the tags on its own connection
+ */
+typedef struct worker {
+    pthread_t thread;
+    int index;
+    int count;
+    int type;
+    const char *path;
+    int columnar;
+    writeQueue *queue;
+    int started;
+    int64_t jobs;
+    double busy;
+    rollupMetrics metrics;  // handed over to the writer once the worker is done
+    int rc;
+} worker;
+
+static void queuePush (writeQueue *q, const writeItem *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == QUEUE_SIZE) {
+        pthread_cond_wait(&q->notFull, &q->lock);
+    }
+    q->items[(q->head + q->count) % QUEUE_SIZE] = *item;
+    q->count++;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * \brief Take the next computed job
+ * @param q The queue
+ * @param item The job
+ * @return 0 when the queue is empty and all workers are gone
+ */
+static int queuePop (writeQueue *q, writeItem *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) {
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    }
+    int got = q->count > 0;
+    if (got) {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->notFull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+static void queueDone (writeQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->producers--;
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * \brief Worker thread. Computes the buckets of every job whose tag falls in
+ *        its share and hands them to the writer
+ * @param arg The worker
+ * @return NULL
+ */
+static void *workerRun (void *arg) {
+    worker *w = arg;
+    sqlite3 *db;
+    rollupCtx ctx;
+    w->rc = sqlite3_open_v2(w->path, &db, SQLITE_OPEN_READONLY, NULL);
+    if (w->rc == SQLITE_OK) {
+        sqlite3_busy_timeout(db, 5000);
+        rollupCtxInit(&ctx, db);
+        ctx.columnar = w->columnar;
+        sqlite3_stmt *st = stmtGet(&ctx, STMT_JOB_SELECT_SHARD);
+        if (st != NULL) {
+            sqlite3_bind_int (st, 1, w->type);
+            sqlite3_bind_int (st, 2, w->count);
+            sqlite3_bind_int (st, 3, w->index);
+            int64_t t = monotonicNanos();
+            while ((w->rc = sqlite3_step(st)) == SQLITE_ROW) {
+                metricsRecord(&ctx.metrics, METRIC_JOB_FETCH, monotonicNanos() - t);
+                writeItem item;
+                double start = monotonicSeconds();
+                item.id =    sqlite3_column_int64 (st, 0);
+                item.tagId = sqlite3_column_int64 (st, 1);
+                time_t ts =  sqlite3_column_int64 (st, 2);
+                int rc = computeJob(&ctx, item.tagId, w->type, ts, &item.start, &item.b);
+                w->busy += monotonicSeconds() - start;
+                if (rc != SQLITE_OK) {
+                    w->rc = rc;     // the job stays queued for the next run
+                    break;
+                }
+                queuePush(w->queue, &item);
+                w->jobs++;
+                t = monotonicNanos();
+            }
+            sqlite3_reset(st);
+            if (w->rc == SQLITE_DONE) {
+                w->rc = SQLITE_OK;
+            }
+        } else {
+            w->rc = SQLITE_ERROR;
+        }
+        rollupCtxRelease(&ctx);
+        w->metrics = ctx.metrics;
+    } else {
+        printf ("Worker %d cannot open %s\n", w->index, w->path);
+    }
+    sqlite3_close(db);
+    queueDone(w->queue);
+    return NULL;
+}
+
+/**
+ * \brief Do one type of data roll up with ctx->threads workers
+ *        Jobs are split by tag ID, as jobs of different tags never touch the
+ *        same rows. Each worker reads on its own connection and all the
+ *        writes go through ctx, the only writer, in batched transactions
+ * @param ctx The connection context. Its database must be a file
+ * @param type The roll up type. See enAggregationType
+ * @return 0 if all good
+ */
+int rollupParallel (rollupCtx *ctx, int type) {
+    int rc = SQLITE_OK;
+    int i;
+    const char *path = sqlite3_db_filename(ctx->db, "main");
+    if (path == NULL || path[0] == 0) {
+        printf ("Parallel roll up needs a database file\n");
+        return SQLITE_MISUSE;
+    }
+    writeQueue *queue = calloc(1, sizeof (writeQueue));
+    worker *workers = calloc(ctx->threads, sizeof (worker));
+    if (queue == NULL || workers == NULL) {
+        free(queue);
+        free(workers);
+        return SQLITE_NOMEM;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+    queue->producers = ctx->threads;
+    double start = monotonicSeconds();
+    for (i = 0; i < ctx->threads; i++) {
+        workers[i].index = i;
+        workers[i].count = ctx->threads;
+        workers[i].type = type;
+        workers[i].path = path;
+        workers[i].columnar = ctx->columnar;
+        workers[i].queue = queue;
+        if (pthread_create(&workers[i].thread, NULL, workerRun, &workers[i]) == 0) {
+            workers[i].started = 1;
+        } else {
+            workers[i].rc = SQLITE_ERROR;
+            queueDone(queue);
+        }
+    }
+    int batched = ctx->batchJobs > 0 && ctx->store->methods->xAutocommit(ctx->store);
+    if (batched && (rc = batchBegin(ctx)) != SQLITE_OK) {
+        batched = 0;
+    }
+    writeItem item;
+    double writerBusy = 0;
+    while (queuePop(queue, &item)) {
+        if (rc != SQLITE_OK) {
+            continue;   // keep draining so no worker stays blocked
+        }
+        double t = monotonicSeconds();
+        rc = applyJob(ctx, item.id, item.tagId, type, item.start, &item.b);
+        if (rc == SQLITE_OK && batched && (rc = batchStep(ctx)) != SQLITE_OK) {
+            batched = 0;
+        }
+        writerBusy += monotonicSeconds() - t;
+        if (metricsDumpPending()) {
+            rollupBacklog(ctx);
+            metricsDump(&ctx->metrics, stdout);     // the workers are merged at the end
+        }
+    }
+    if (batched) {
+        rc = batchEnd(ctx, rc);
+    }
+    double elapsed = monotonicSeconds() - start;
+    for (i = 0; i < ctx->threads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        metricsMerge(&ctx->metrics, &workers[i].metrics);
+        if (workers[i].rc != SQLITE_OK && rc == SQLITE_OK) {
+            rc = workers[i].rc;
+        }
+        printf ("  worker %d: %" PRId64 " jobs, busy %.3f s, utilization %.0f%%\n",
+                i, workers[i].jobs, workers[i].busy, 100 * workers[i].busy / elapsed);
+    }
+    printf ("  writer: busy %.3f s, utilization %.0f%%\n", writerBusy, 100 * writerBusy / elapsed);
+    pthread_cond_destroy(&queue->notFull);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_mutex_destroy(&queue->lock);
+    free(workers);
+    free(queue);
+    return rc;
+}
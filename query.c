@@ -0,0 +1,111 @@
+/*
+ * Range queries over the roll up levels
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+static void queryBucket (void *arg, int64_t ts, const rollupBucket *b) {
+    rollupQuery *q = arg;
+    foldBucket(&q->b, b);
+    q->bucketsRead++;
+}
+
+static void querySample (void *arg, int64_t ts, double value) {
+    rollupQuery *q = arg;
+    foldSample(&q->b, value);
+    q->samplesRead++;
+}
+
+/**
+ * \brief Fold (from, to] into the query using levels up to type
+ *        The whole buckets of the level are read, and what is left on
+ *        either side goes one level down, down to the raw samples
+ * @param ctx The connection context
+ * @param q The query
+ * @param from Range start, excluded
+ * @param to Range end, included
+ * @param type The coarsest level to use. See enAggregationType
+ * @return 0 if all good
+ */
+static int queryLevel (rollupCtx *ctx, rollupQuery *q, int64_t from, int64_t to, int type) {
+    rollupStore *s = ctx->store;
+    if (from >= to) {
+        return SQLITE_OK;
+    }
+    if (type == ROLLUP_RAW) {
+        return s->methods->xScanSamples(s, q->tagId, from, to, querySample, q);
+    }
+    int child = levelGet(type)->child;
+    // a bucket starting at b holds (b, next], so it fits when from <= b and next <= to
+    int64_t first = bucketStart(type, from);
+    if (first < from) {
+        first = bucketNext(type, first);
+    }
+    int64_t last = bucketStart(type, to);
+    if (first >= last) {
+        return queryLevel(ctx, q, from, to, child);
+    }
+    int rc = s->methods->xScanBuckets(s, q->tagId, type, first, last, queryBucket, q);
+    if (rc == SQLITE_OK) {
+        rc = queryLevel(ctx, q, from, first, child);
+    }
+    if (rc == SQLITE_OK) {
+        rc = queryLevel(ctx, q, last, to, child);
+    }
+    return rc;
+}
+
+/**
+ * \brief Aggregate one tag over (from, to] from the fewest stored rows
+ *        The range is split into the largest whole buckets it holds, from
+ *        the coarsest level down its child levels, and raw samples are read
+ *        only for the ragged edges, so a year with odd endpoints reads a
+ *        few dozen rows. A level off that path, like week, is not used.
+ *        The answer is as fresh as the roll up: samples whose jobs are
+ *        still queued are only counted on the edges
+ * @param ctx The connection context
+ * @param q The query. tagId, from and to in, the rest out
+ * @return 0 if all good
+ */
+int queryRange (rollupCtx *ctx, rollupQuery *q) {
+    memset(&q->b, 0, sizeof (q->b));
+    q->bucketsRead = 0;
+    q->samplesRead = 0;
+    int rc = queryLevel(ctx, q, q->from, q->to, levelAt(levelCount() - 1));
+    if (rc == SQLITE_OK && q->b.vcount > 0) {
+        q->b.vavg = q->b.vsum / q->b.vcount;
+    }
+    return rc;
+}
@@ -0,0 +1,314 @@
+/*
+ * Retention of the raw samples and the roll up levels
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+/*
+ * A level is kept for KeepDays and then purged, oldest first, but only
+ * where the level above already holds it: the rows of a parent bucket are
+ * counted and must add up to the parent's vcount. Pending jobs hold the
+ * purge back, since they still have to read the level.
+ *
+ * A late sample whose hour the raw retention already purged cannot have
+ * that hour rolled up again from History, which lost the other samples.
+ * Such a sample is merged into the stored hour instead, see
+ * retentionHorizon, and the levels above are queued as usual.
+ */
+
+/*
+ * Rows in a purge window, and the samples they stand for
+ */
+typedef struct retentionCount {
+    int64_t rows;
+    int64_t weight;
+} retentionCount;
+
+/*
+ * The tags to look at, gathered before anything is deleted
+ */
+typedef struct retentionTags {
+    int64_t *id;
+    int count;
+    int capacity;
+} retentionTags;
+
+static void countSample (void *arg, int64_t ts, double value) {
+    retentionCount *c = arg;
+    c->rows++;
+    c->weight += value == value;    // a missing sample is in no bucket
+}
+
+static void countBucket (void *arg, int64_t ts, const rollupBucket *b) {
+    retentionCount *c = arg;
+    c->rows++;
+    c->weight += b->vcount;
+}
+
+static void addTag (void *arg, int64_t tagId) {
+    retentionTags *t = arg;
+    if (t->count == t->capacity) {
+        int n = t->capacity ? t->capacity * 2 : 64;
+        int64_t *p = realloc(t->id, n * sizeof (int64_t));
+        if (p == NULL) {
+            return;
+        }
+        t->id = p;
+        t->capacity = n;
+    }
+    t->id[t->count++] = tagId;
+}
+
+/**
+ * \brief Days a tag keeps a level
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param keepDays The days, -1 to keep it all
+ * @return 0 if all good
+ */
+static int retentionKeep (rollupCtx *ctx, int64_t tagId, int type, int *keepDays) {
+    sqlite3_stmt *st = stmtGet(ctx, STMT_RETENTION_SELECT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    sqlite3_bind_int   (st, 2, type);
+    int rc = sqlite3_step(st);
+    *keepDays = rc == SQLITE_ROW ? sqlite3_column_int(st, 0) : -1;
+    sqlite3_reset(st);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Where the raw samples of a tag still hold whole buckets
+ *        The samples are purged oldest first, whole buckets of the finest
+ *        level at a time, so a bucket starting before both the raw cutoff
+ *        and the oldest sample left has no samples to roll up from
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param now The current time, UTC
+ * @param horizon The first bucket start of the finest level still kept,
+ *        INT64_MIN when the samples are kept forever
+ * @return 0 if all good
+ */
+int retentionHorizon (rollupCtx *ctx, int64_t tagId, int64_t now, int64_t *horizon) {
+    rollupStore *s = ctx->store;
+    int base = levelAt(0);
+    int keepDays;
+    int64_t ts;
+    *horizon = INT64_MIN;
+    int rc = retentionKeep(ctx, tagId, ROLLUP_RAW, &keepDays);
+    if (rc != SQLITE_OK || keepDays < 0) {
+        return rc;
+    }
+    *horizon = bucketStart(base, now - (int64_t)keepDays * 86400);
+    rc = s->methods->xOldest(s, tagId, ROLLUP_RAW, &ts);
+    if (rc == SQLITE_OK && bucketStart(base, ts - 1) < *horizon) {
+        *horizon = bucketStart(base, ts - 1);
+    }
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Purge one level of one tag
+ *        The windows are whole buckets of the level above on the way to
+ *        the top, sized to hold about RETENTION_ROWS rows, each one in its
+ *        own transaction. A level with nothing above it is not checked
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param now The current time, UTC
+ * @param stats Updated
+ * @return 0 if all good
+ */
+static int retentionLevel (rollupCtx *ctx, int64_t tagId, int type, int64_t now, retentionStats *stats) {
+    rollupStore *s = ctx->store;
+    const rollupLevel *level = levelGet(type);
+    int base = levelAt(0);
+    int parent = level == NULL ? base : level->parent >= 0 ? level->parent : type;
+    int keepDays, span = 1, i;
+    int64_t ts, start, end = INT64_MIN;
+    int rc = retentionKeep(ctx, tagId, type, &keepDays);
+    if (rc != SQLITE_OK || keepDays < 0) {
+        return rc;
+    }
+    int64_t cutoff = bucketStart(parent, now - (int64_t)keepDays * 86400);
+    int64_t wanted = cutoff;
+    // the jobs of the level and of every level folded from it still read it
+    for (i = -1; i < (level != NULL ? level->parentCount : 1); i++) {
+        int held = i < 0 ? type : level != NULL ? level->parents[i] : base;
+        if (held != ROLLUP_RAW && s->methods->xJobOldest(s, tagId, held, &ts) == SQLITE_OK &&
+            bucketStart(parent, ts) < cutoff) {
+            cutoff = bucketStart(parent, ts);
+        }
+    }
+    while ((rc = s->methods->xOldest(s, tagId, type, &ts)) == SQLITE_OK) {
+        // a sample on a boundary belongs to the bucket before it
+        start = bucketStart(parent, type == ROLLUP_RAW ? ts - 1 : ts);
+        if (start < end) {
+            start = end;            // a block that runs past the last window
+        }
+        if (start >= cutoff) {
+            break;
+        }
+        for (end = start, i = 0; i < span && end < cutoff; i++) {
+            end = bucketNext(parent, end);
+        }
+        retentionCount rows = {0, 0}, cover = {0, 0};
+        int64_t deleted = 0;
+        int autocommit = s->methods->xAutocommit(s);
+        if (autocommit && (rc = s->methods->xBegin(s)) != SQLITE_OK) {
+            break;
+        }
+        if (parent != type) {
+            rc = type == ROLLUP_RAW ?
+                s->methods->xScanSamples(s, tagId, start, end, countSample, &rows) :
+                s->methods->xScanBuckets(s, tagId, type, start, end, countBucket, &rows);
+            if (rc == SQLITE_OK) {
+                rc = s->methods->xScanBuckets(s, tagId, parent, start, end, countBucket, &cover);
+            }
+            if (rc == SQLITE_OK && rows.weight != cover.weight) {
+                char dt[32];
+                printf ("Tag %" PRId64 " level %d: %" PRId64 " samples from %s are not rolled up (%" PRId64 "), kept\n",
+                        tagId, type, rows.weight, tt2iso8602(start, dt), cover.weight);
+                stats->uncovered++;
+                rc = SQLITE_ABORT;
+            }
+        }
+        if (rc == SQLITE_OK) {
+            rc = s->methods->xPurge(s, tagId, type, end, &deleted);
+        }
+        if (autocommit) {
+            if (rc == SQLITE_OK) {
+                rc = s->methods->xCommit(s);
+            } else {
+                s->methods->xRollback(s);
+            }
+        }
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        stats->deleted[type - ROLLUP_RAW] += deleted;
+        stats->chunks++;
+        if (s->methods->xVacuum(s, RETENTION_VACUUM_PAGES) == SQLITE_DONE) {
+            stats->unvacuumed = 1;
+        }
+        // aim the next window at RETENTION_ROWS
+        if (parent == type) {
+            rows.rows = deleted;
+        }
+        int64_t next = rows.rows > 0 ? (int64_t)span * RETENTION_ROWS / rows.rows : (int64_t)span * 2;
+        span = next < 1 ? 1 : next > RETENTION_SPAN_MAX ? RETENTION_SPAN_MAX : (int)next;
+    }
+    if (rc == SQLITE_DONE || rc == SQLITE_ABORT) {
+        rc = SQLITE_OK;
+    }
+    if (rc == SQLITE_OK && cutoff < wanted && end < wanted) {
+        stats->held++;
+    }
+    return rc;
+}
+
+/**
+ * \brief Purge what every tag keeps no more, per RetentionPolicy
+ *        The new jobs are written first, so they hold back what they read
+ * @param ctx The connection context
+ * @param now The current time, UTC
+ * @param stats Filled
+ * @return 0 if all good
+ */
+int retentionRun (rollupCtx *ctx, int64_t now, retentionStats *stats) {
+    rollupStore *s = ctx->store;
+    retentionTags tags = {NULL, 0, 0};
+    int i, j;
+    memset(stats, 0, sizeof (*stats));
+    int rc = jobFlush(ctx);
+    if (rc == SQLITE_OK) {
+        rc = s->methods->xListTags(s, addTag, &tags);
+    }
+    for (i = 0; i < tags.count && rc == SQLITE_OK; i++) {
+        for (j = -1; j < levelCount() && rc == SQLITE_OK; j++) {
+            rc = retentionLevel(ctx, tags.id[i], j < 0 ? ROLLUP_RAW : levelAt(j), now, stats);
+        }
+    }
+    stats->tags = tags.count;
+    free(tags.id);
+    return rc;
+}
+
+/**
+ * \brief Switch the database to auto_vacuum=INCREMENTAL, once
+ *        The switch only takes with a full VACUUM, which rewrites the whole
+ *        file and needs as much free disk; later retention passes then give
+ *        the purged pages back a few at a time
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+int retentionVacuum (rollupCtx *ctx) {
+    int rc = execSql(ctx->db, "PRAGMA auto_vacuum=INCREMENTAL;");
+    if (rc == SQLITE_OK) {
+        rc = execSql(ctx->db, "VACUUM;");
+    }
+    return rc;
+}
+
+/**
+ * \brief Set how long a tag keeps a level
+ * @param ctx The connection context
+ * @param tagId The tag ID, 0 for every tag without its own policy
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param keepDays The days, negative to drop the policy and keep it all
+ * @return 0 if all good
+ */
+int retentionSet (rollupCtx *ctx, int64_t tagId, int type, int keepDays) {
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_prepare_v2(ctx->db, keepDays < 0 ?
+            "delete from retentionpolicy where tagid = ?1 and type = ?2;" :
+            "insert or replace into retentionpolicy (tagid, type, keepdays) values (?1, ?2, ?3);",
+            -1, &st, NULL);
+    if (rc != SQLITE_OK) {
+        printf ("%s\n", sqlite3_errmsg(ctx->db));
+        return rc;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    sqlite3_bind_int   (st, 2, type);
+    if (keepDays >= 0) {
+        sqlite3_bind_int (st, 3, keepDays);
+    }
+    rc = sqlite3_step(st);
+    sqlite3_finalize(st);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
@@ -38,24 +38,130 @@
 #include <math.h>
 #include <inttypes.h>
 #include <time.h>
+#include <unistd.h>
 #include "sqlite3.h"
+#include "calendar.h"
+#include "rollup.h"
+#include "block.h"
+#include "kernel.h"
 
-time_t elapsedControl;
+int64_t elapsedControl;
+
+/* INGEST_ROWS (64) value tuples for the bulk history insert */
+#define ROW1    "(?,?,?)"
+#define ROW4    ROW1 "," ROW1 "," ROW1 "," ROW1
+#define ROW16   ROW4 "," ROW4 "," ROW4 "," ROW4
+#define ROW64   ROW16 "," ROW16 "," ROW16 "," ROW16
+
+static const char *stmtSql[STMT_COUNT] = {
+    /* STMT_JOB_INSERT */
+    "insert into job (tagid, type, ts) values (?1, ?2, ?3);",
+    /* STMT_JOB_SELECT */
+    "select id, tagid, ts from job where type = ?1 order by tagid, ts;",
+    /* STMT_JOB_DELETE */
+    "delete from job where id = ?1;",
+    /* STMT_HISTORY_INSERT */
+    "insert into history (tagid, value, ts) values (?1, ?2, ?3);",
+    /* STMT_HISTORY_SELECT */
+    "select ts, value from history where tagid = ?1 and ts > ?2 and ts <= ?3;",
+    /* STMT_ROLLUP_SELECT */
+    "select vsum, vmax, vmin, vcount, vm2, sketch, ts"
+    " from rollup where tagid = ?1 and type = ?2 and ts >= ?3 and ts < ?4;",
+    /* STMT_ROLLUP_INSERT */
+    "insert into rollup (tagid, type, vsum, vavg, vmax, vmin, vcount, ts, sketch, vm2, vstddev)"
+    " values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11);",
+    /* STMT_ROLLUP_UPDATE */
+    "update rollup set vsum = ?3, vavg = ?4, vmax = ?5, vmin = ?6, vcount = ?7, sketch = ?9,"
+    " vm2 = ?10, vstddev = ?11"
+    " where tagid = ?1 and type = ?2 and ts = ?8;",
+    /* STMT_ROLLUP_UPSERT */
+    "insert into rollup (tagid, type, vsum, vavg, vmax, vmin, vcount, ts, sketch, vm2, vstddev)"
+    " values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11)"
+    " on conflict (tagid, type, ts) do update set"
+    " vsum = excluded.vsum, vavg = excluded.vavg, vmax = excluded.vmax,"
+    " vmin = excluded.vmin, vcount = excluded.vcount, sketch = excluded.sketch,"
+    " vm2 = excluded.vm2, vstddev = excluded.vstddev;",
+    /* STMT_TAG_SELECT */
+    "select distinct tagid from history order by tagid;",
+    /* STMT_HISTORY_SCAN */
+    "select ts, value from history where tagid = ?1 order by ts;",
+    /* STMT_ROLLUP_DELETE_TAG */
+    "delete from rollup where tagid = ?1;",
+    /* STMT_JOB_DELETE_TAG */
+    "delete from job where tagid = ?1;",
+    /* STMT_JOB_SELECT_SHARD */
+    "select id, tagid, ts from job where type = ?1 and ((tagid % ?2) + ?2) % ?2 = ?3"
+    " order by tagid, ts;",
+    /* STMT_HISTORY_INSERT_BULK */
+    "insert into history (tagid, ts, value) values " ROW64 ";",
+    /* STMT_ROLLUP_BUCKET */
+    "select vsum, vmax, vmin, vcount, vm2, sketch"
+    " from rollup where tagid = ?1 and type = ?2 and ts = ?3;",
+    /* STMT_BLOCK_FIND */
+    "select b.t0, b.t1, b.count, b.data,"
+    " (select min(t0) from historyblock where tagid = ?1 and t0 > ?2)"
+    " from (select 1) left join (select t0, t1, count, data from historyblock"
+    " where tagid = ?1 and t0 <= ?2 order by t0 desc limit 1) b on 1;",
+    /* STMT_BLOCK_INSERT */
+    "insert into historyblock (tagid, t0, t1, count, data) values (?1, ?2, ?3, ?4, ?5);",
+    /* STMT_BLOCK_DELETE */
+    "delete from historyblock where tagid = ?1 and t0 = ?2;",
+    /* STMT_BLOCK_RANGE */
+    "select t0, count, data from historyblock where tagid = ?1 and t0 <= ?3 and t0 >="
+    " coalesce((select max(t0) from historyblock where tagid = ?1 and t0 <= ?2), ?2)"
+    " order by t0;",
+    /* STMT_TAG_SELECT_BLOCK */
+    "select distinct tagid from historyblock order by tagid;",
+    /* STMT_JOB_COUNT */
+    "select count(*) from job where type = ?1;",
+    /* STMT_HISTORY_OLDEST */
+    "select min(ts) from history where tagid = ?1;",
+    /* STMT_BLOCK_OLDEST */
+    "select min(t0) from historyblock where tagid = ?1;",
+    /* STMT_ROLLUP_OLDEST */
+    "select min(ts) from rollup where tagid = ?1 and type = ?2;",
+    /* STMT_JOB_OLDEST */
+    "select min(ts) from job where tagid = ?1 and type = ?2;",
+    /* STMT_HISTORY_PURGE */
+    "delete from history where tagid = ?1 and ts <= ?2;",
+    /* STMT_BLOCK_PURGE, whole blocks only */
+    "delete from historyblock where tagid = ?1 and t0 <= ?2 and t1 <= ?2;",
+    /* STMT_ROLLUP_PURGE */
+    "delete from rollup where tagid = ?1 and type = ?2 and ts < ?3;",
+    /* STMT_ROLLUP_TAGS, one index seek per tag */
+    "with recursive t (id) as (select min(tagid) from rollup"
+    " union all select (select min(tagid) from rollup where tagid > t.id) from t where t.id is not null)"
+    " select id from t where id is not null;",
+    /* STMT_RETENTION_SELECT, the tag's own policy first, then the default */
+    "select keepdays from retentionpolicy where type = ?2 and tagid in (?1, 0)"
+    " order by tagid desc limit 1;",
+    /* STMT_JOB_OLDEST_TYPE */
+    "select min(ts) from job where type = ?1;",
+    /* STMT_DATA_VERSION, moves on when another connection commits */
+    "pragma data_version;",
+    /* STMT_MARK_SELECT */
+    "select ts from watermark where type = ?2 and tagid = ?1;",
+    /* STMT_MARK_OLDEST */
+    "select min(ts) from watermark where type = ?1;",
+    /* STMT_MARK_UPSERT */
+    "insert or replace into watermark (type, tagid, ts) values (?2, ?1, ?3);",
+    /* STMT_MARK_SCAN */
+    "select tagid, ts from watermark where type = ?1 order by tagid;",
+    /* STMT_HISTORY_AGG */
+    "select rollup_agg(value), count(*) from history where tagid = ?1 and ts > ?2 and ts <= ?3;",
+    /* STMT_ROLLUP_AGG */
+    "select rollup_merge(vsum, vmax, vmin, vcount, vm2, sketch), count(*)"
+    " from rollup where tagid = ?1 and type = ?2 and ts >= ?3 and ts < ?4;"
+};
 
-enum {
-    ROLLUP_HOUR = 0,
-    ROLLUP_DAY,
-    ROLLUP_MONTH,
-    ROLLUP_YEAR
-} enAggregationType;
 
 /**
  * \brief Lap count
  * @param message
  */
 void lap (const char *message) {
-    time_t t = time(NULL);
-    printf ("%s. New lap %ld seconds\n", message, (long)(t - elapsedControl));
+    int64_t t = monotonicNanos();
+    printf ("%s. New lap %.3f seconds\n", message, (t - elapsedControl) / 1e9);
     elapsedControl = t;
 }
 
@@ -65,7 +171,7 @@ void lap (const char *message) {
  * @param sql The query to be executed
  * @return 0 if all good
  */
-int execSql(sqlite3 *db, const char *sql) {
+int execSql (sqlite3 *db, const char *sql) {
     int rc = sqlite3_exec(db, sql, NULL, 0, NULL);
     if (rc && (rc != SQLITE_CONSTRAINT)) {
         printf ("Error %d (%s) Query:%s\n", rc, sqlite3_errmsg(db), sql);
@@ -73,6 +179,290 @@ int execSql(sqlite3 *db, const char *sql) {
     return rc;
 }
 
+#ifndef ROLLUP_EXTENSION
+/**
+ * \brief Count every commit on the connection, explicit or autocommit
+ * @param arg The connection context
+ * @return 0 so the commit goes on
+ */
+static int commitHook (void *arg) {
+    ((rollupCtx *)arg)->commits++;
+    return 0;
+}
+#endif
+
+/**
+ * \brief Initialize a connection context
+ * @param ctx The context
+ * @param db The database connection
+ */
+void rollupCtxInit (rollupCtx *ctx, sqlite3 *db) {
+    memset(ctx, 0, sizeof (*ctx));
+    ctx->db = db;
+    ctx->upsertMode = sqlite3_libversion_number() >= 3024000 ? UPSERT_NATIVE : UPSERT_TWO_STEP;
+    ctx->batchJobs = BATCH_JOBS_DEFAULT;
+    ctx->batchMillis = BATCH_MILLIS_DEFAULT;
+    ctx->threads = 1;
+#ifndef ROLLUP_EXTENSION
+    // loaded as an extension the commit hook is left to the host
+    sqlite3_commit_hook(db, commitHook, ctx);
+#endif
+    aggregateRegister(db);
+    seriesRegister(db);
+    ctx->store = storeOpenSqlite(ctx);
+}
+
+/**
+ * \brief Close the store and finalize all cached statements of a context
+ *        The database connection is not closed
+ * @param ctx The context
+ */
+void rollupCtxRelease (rollupCtx *ctx) {
+    if (ctx->store != NULL) {
+        jobFlush(ctx);
+        ctx->store->methods->xClose(ctx->store);
+        ctx->store = NULL;
+    }
+    jobSetFree(&ctx->dirty);
+    dirtyFree(&ctx->ranges);
+    blockCacheFree(ctx);
+    free(ctx->pending);
+    ctx->pending = NULL;
+    free(ctx->values.values);
+    memset(&ctx->values, 0, sizeof (ctx->values));
+    stmtFinalize(ctx);
+}
+
+/**
+ * \brief Finalize the cached statements, later calls prepare them again
+ *        A connection cannot close while any of them is left
+ * @param ctx The context
+ */
+void stmtFinalize (rollupCtx *ctx) {
+    int i;
+    for (i = 0; i < STMT_COUNT; i++) {
+        if (ctx->stmt[i] != NULL) {
+            sqlite3_finalize(ctx->stmt[i]);
+            ctx->stmt[i] = NULL;
+        }
+    }
+}
+
+/**
+ * \brief Get a ready to bind statement from the cache
+ *        The statement is prepared on first use. Later calls reset it and
+ *        clear the previous bindings
+ * @param ctx The context
+ * @param id The statement. See enStatement
+ * @return The statement or NULL on error
+ */
+sqlite3_stmt *stmtGet (rollupCtx *ctx, int id) {
+    sqlite3_stmt *st = ctx->stmt[id];
+    if (st != NULL) {
+        sqlite3_reset(st);
+        sqlite3_clear_bindings(st);
+        ctx->stmtReused++;
+        return st;
+    }
+    int rc = sqlite3_prepare_v2(ctx->db, stmtSql[id], -1, &st, NULL);
+    if (rc != SQLITE_OK) {
+        ctx->metrics.sqliteErrors++;
+        printf ("%s - %s\n", sqlite3_errmsg(ctx->db), stmtSql[id]);
+        return NULL;
+    }
+    ctx->stmt[id] = st;
+    ctx->stmtPrepared++;
+    return st;
+}
+
+/**
+ * \brief Step a statement that returns no rows and reset it
+ * @param ctx The context
+ * @param st The statement
+ * @return 0 if all good
+ */
+int stmtExec (rollupCtx *ctx, sqlite3_stmt *st) {
+    int rc = sqlite3_step(st);
+    if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+    } else if (rc != SQLITE_CONSTRAINT) {
+        ctx->metrics.sqliteErrors++;
+        printf ("Error %d (%s) Query:%s\n", rc, sqlite3_errmsg(ctx->db), sqlite3_sql(st));
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+/**
+ * \brief Forget every queued job
+ *        Used when the job table may no longer match the dirty set
+ * @param ctx The connection context
+ */
+static void jobForget (rollupCtx *ctx) {
+    jobSetClear(&ctx->dirty);
+    dirtyClear(&ctx->ranges);
+    ctx->pendingCount = 0;
+}
+
+/**
+ * \brief Queue a job unless it is already pending since the last flush
+ * @param arg The connection context
+ * @param tagId The tag ID
+ * @param type The aggregation type
+ * @param ts The bucket start
+ * @return 0 if all good
+ */
+static int jobPush (void *arg, int64_t tagId, int type, int64_t ts) {
+    rollupCtx *ctx = arg;
+    jobKey key = {tagId, ts, type};
+    ctx->jobRequests++;
+    int rc = jobSetAdd(&ctx->dirty, &key);
+    if (rc == 0) {
+        ctx->jobCoalesced++;
+        return SQLITE_OK;
+    }
+    if (rc < 0) {
+        return SQLITE_NOMEM;
+    }
+    if (ctx->pendingCount == ctx->pendingCapacity) {
+        int capacity = ctx->pendingCapacity ? ctx->pendingCapacity * 2 : 256;
+        jobKey *pending = realloc(ctx->pending, capacity * sizeof (jobKey));
+        if (pending == NULL) {
+            return SQLITE_NOMEM;
+        }
+        ctx->pending = pending;
+        ctx->pendingCapacity = capacity;
+    }
+    ctx->pending[ctx->pendingCount++] = key;
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Write the jobs queued since the last flush into the job table
+ *        Only distinct new jobs ever get here. One may still be in the table
+ *        from an earlier run, that insert just fails on Job_Index01. The
+ *        dirty ranges are turned into jobs first, every level at once. With
+ *        ctx->watermark only the jobs behind their watermark are written
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+int jobFlush (rollupCtx *ctx) {
+    // with ctx->incremental the finest level is already up to date
+    int rc = dirtyDrain(&ctx->ranges, ctx->incremental ? 1 : 0, jobPush, ctx);
+    int i;
+    if (rc != SQLITE_OK) {
+        jobForget(ctx);
+        return rc;
+    }
+    if (ctx->pendingCount == 0) {
+        return rc;
+    }
+    int64_t t = monotonicNanos();
+    rollupStore *s = ctx->store;
+    for (i = 0; i < ctx->pendingCount && rc == SQLITE_OK; i++) {
+        if (ctx->watermark) {
+            int behind = 0;
+            rc = markBehind(ctx, &ctx->pending[i], &behind);
+            if (!behind) {
+                ctx->jobsAhead += rc == SQLITE_OK;
+                continue;
+            }
+        }
+        rc = s->methods->xJobInsert(s, &ctx->pending[i]);
+        if (rc == SQLITE_OK) {
+            ctx->jobRows++;
+        } else if (rc == SQLITE_CONSTRAINT) {
+            rc = SQLITE_OK;
+        }
+    }
+    ctx->pendingCount = 0;
+    // once written a job may be run by any connection, so a later sample
+    // must queue it again: the set only spans one flush
+    jobSetClear(&ctx->dirty);
+    metricsRecord(&ctx->metrics, METRIC_JOB_FLUSH, monotonicNanos() - t);
+    return rc;
+}
+
+/**
+ * \brief Count the dirty buckets of every level into ctx->metrics.backlog
+ *        Jobs in the store, jobs not yet flushed and buckets still in the
+ *        dirty ranges all count. The last two are this connection's only
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+int rollupBacklog (rollupCtx *ctx) {
+    int64_t *backlog = ctx->metrics.backlog;
+    rollupStore *s = ctx->store;
+    int rc = SQLITE_OK;
+    int i;
+    memset(backlog, 0, sizeof (ctx->metrics.backlog));
+    dirtyBacklog(&ctx->ranges, ctx->incremental ? 1 : 0, backlog);
+    for (i = 0; i < ctx->pendingCount; i++) {
+        backlog[ctx->pending[i].type]++;
+    }
+    for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+        int64_t count = 0;
+        rc = s->methods->xJobCount(s, levelAt(i), &count);
+        backlog[levelAt(i)] += count;
+    }
+    return rc;
+}
+
+/**
+ * \brief Open a job batch transaction
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+int batchBegin (rollupCtx *ctx) {
+    ctx->batchCount = 0;
+    ctx->batchStart = monotonicSeconds();
+    return ctx->store->methods->xBegin(ctx->store);
+}
+
+/**
+ * \brief Close the job batch transaction
+ *        A batch holds the rollup writes, the job deletes and the next level
+ *        jobs together, so it is either applied as a whole or rolled back
+ *        leaving its jobs in place to be replayed on the next run
+ * @param ctx The connection context
+ * @param rc The status of the batch so far
+ * @return 0 if all good
+ */
+int batchEnd (rollupCtx *ctx, int rc) {
+    if (rc == SQLITE_OK) {
+        rc = jobFlush(ctx);
+    }
+    if (rc == SQLITE_OK) {
+        int64_t t = monotonicNanos();
+        rc = ctx->store->methods->xCommit(ctx->store);
+        metricsRecord(&ctx->metrics, METRIC_COMMIT, monotonicNanos() - t);
+    }
+    if (rc != SQLITE_OK) {
+        ctx->store->methods->xRollback(ctx->store);
+        jobForget(ctx);
+    }
+    return rc;
+}
+
+/**
+ * \brief Account one job in the batch and roll over to a new transaction
+ *        when the job count or the time limit is reached
+ * @param ctx The connection context
+ * @return 0 if all good
+ */
+int batchStep (rollupCtx *ctx) {
+    int rc = SQLITE_OK;
+    ctx->batchCount++;
+    if (ctx->batchCount >= ctx->batchJobs ||
+        (monotonicSeconds() - ctx->batchStart) * 1000 >= ctx->batchMillis) {
+        rc = batchEnd(ctx, SQLITE_OK);
+        if (rc == SQLITE_OK) {
+            rc = batchBegin(ctx);
+        }
+    }
+    return rc;
+}
+
 /**
  * \brief Format a time stamp in ISOData format
  * @param tt The time stamp
@@ -100,410 +490,660 @@ time_t iso8602ts (const char *isoDate) {
 }
 
 /**
- * \brief Add one year to the time stamp
- * @param ts The time stamp
- * @return The adjusted time stamp
+ * \brief Update the JOB table
+ *        Jobs go through the dirty set first, so a bucket is queued once per
+ *        flush no matter how many samples or child buckets touch it. Inside a
+ *        transaction new jobs are written in groups of JOB_FLUSH_SIZE and
+ *        right before the commit
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The aggregation type
+ * @param utc A sample time stamp for the finest level, a child bucket
+ *        start for the others
+ * @return 
  */
-static time_t timeAddYear (time_t ts) {
-    struct tm tm;
-    localtime_r(&ts, &tm);
-    tm.tm_year++;
-    time_t tt = mktime(&tm);
-    return tt;
+int updateRollupControl (rollupCtx *ctx, int64_t tagId, int type, time_t utc) {
+    int rc;
+    const rollupLevel *level = levelGet(type);
+    if (level == NULL) {
+        return SQLITE_OK;
+    }
+    utc = bucketStart(type, level->child == ROLLUP_RAW ? utc - 1 : utc);
+    rc = jobPush(ctx, tagId, type, (int64_t)utc);
+    // outside a transaction there is no commit to wait for
+    if (rc == SQLITE_OK &&
+        (ctx->pendingCount >= JOB_FLUSH_SIZE || ctx->store->methods->xAutocommit(ctx->store))) {
+        rc = jobFlush(ctx);
+    }
+    return rc;
 }
 
 /**
- * \brief Add one month to the time stamp
- * @param ts The time stamp
- * @return The adjusted time stamp
+ * \brief Write one bucket into the roll up table
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The aggregation type
+ * @param ts The bucket start, already aligned to the aggregation type
+ * @param b The bucket values
+ * @return 0 if all good
  */
-static time_t timeAddMonth (time_t ts) {
-    struct tm tm;
-    localtime_r(&ts, &tm);
-    tm.tm_mon++;
-    if (tm.tm_mon >= 12) {
-        tm.tm_mon = 0;
-        tm.tm_year++;
+int writeRollup (rollupCtx *ctx, int64_t tagId, int type, time_t ts, const rollupBucket *b) {
+    rollupStore *s = ctx->store;
+    int rc = s->methods->xWriteBucket(s, tagId, type, (int64_t)ts, b);
+    if (rc == SQLITE_OK) {
+        ctx->metrics.rowsWritten[type]++;
+    } else {
+        printf ("Error inserting rollup data\n");
     }
-    time_t tt = mktime(&tm);
-    return tt;
+    return rc;
 }
 
 /**
- * \brief Adjust the time stamp for the beginning of the year
- * @param ts The time stamp
- * @return Adjusted time stamp
+ * \brief Fold one raw sample into a bucket
+ *        The second moment is updated the Welford way, against the mean
+ *        before and after the sample
+ * @param b The bucket
+ * @param value The sample
  */
+void foldSample (rollupBucket *b, double value) {
+    if (value != value) {
+        return;     // NaN, a missing sample
+    }
+    if (b->vcount == 0 || value > b->vmax) {
+        b->vmax = value;
+    }
+    if (b->vcount == 0 || value < b->vmin) {
+        b->vmin = value;
+    }
+    double before = b->vcount > 0 ? value - b->vsum / b->vcount : 0;
+    b->vsum += value;
+    b->vcount++;
+    b->vm2 += before * (value - b->vsum / b->vcount);
+    tdigestAdd(&b->sketch, value, 1);
+}
 
-time_t getStartOfYear (time_t ts) {
-    struct tm tm;
-    localtime_r (&ts, &tm);
-    tm.tm_sec = 0;
-    tm.tm_min = 0;
-    tm.tm_hour = 0;
-    tm.tm_mday = 1;
-    tm.tm_mon = 0;
-    time_t t = mktime(&tm);
-    return t;
+/**
+ * \brief Fold an array of samples into a bucket
+ *        The sums go through the vector kernel, so an array gives the same
+ *        bucket whatever store it came from, as long as it is the same
+ *        array: callers fold the samples of a bucket in one call
+ * @param b The bucket
+ * @param values The samples, NaN for a missing one
+ * @param count How many
+ */
+void foldValues (rollupBucket *b, const double *values, int count) {
+    kernelAgg a;
+    int i;
+    kernelAggregate(values, count, &a);
+    if (a.count == 0) {
+        return;
+    }
+    if (b->vcount == 0 || a.max > b->vmax) {
+        b->vmax = a.max;
+    }
+    if (b->vcount == 0 || a.min < b->vmin) {
+        b->vmin = a.min;
+    }
+    if (b->vcount == 0) {
+        b->vm2 = a.m2;
+    } else {
+        double delta = a.sum / a.count - b->vsum / b->vcount;
+        b->vm2 += a.m2 + delta * delta * b->vcount * a.count / (b->vcount + a.count);
+    }
+    b->vsum += a.sum;
+    b->vcount += a.count;
+    for (i = 0; i < count; i++) {
+        if (values[i] == values[i]) {
+            tdigestAdd(&b->sketch, values[i], 1);
+        }
+    }
 }
 
 /**
- * \brief Adjust the time stamp for the beginning of the month
- * @param ts The time stamp
- * @return Adjusted time stamp
+ * \brief Append a sample to a buffer, growing it as needed
+ * @param v The buffer. Its rc is set if it cannot grow
+ * @param value The sample
  */
-time_t getStartOfMonth (time_t ts) {
-    struct tm tm;
-    localtime_r (&ts, &tm);
-    tm.tm_sec = 0;
-    tm.tm_min = 0;
-    tm.tm_hour = 0;
-    tm.tm_mday = 1;
-    time_t t = mktime(&tm);
-    return t;
+void valuePush (valueBuffer *v, double value) {
+    if (v->count == v->capacity) {
+        int capacity = v->capacity ? v->capacity * 2 : 1024;
+        double *values = realloc(v->values, capacity * sizeof (double));
+        if (values == NULL) {
+            v->rc = SQLITE_NOMEM;
+            return;
+        }
+        v->values = values;
+        v->capacity = capacity;
+    }
+    v->values[v->count++] = value;
 }
 
 /**
- * \brief Adjust the time stamp for the beginning of the day
- * @param ts The time stamp
- * @return Adjusted time stamp
+ * \brief Fold a whole bucket into another one, in O(1) but for the sketch
+ *        The second moments combine with the difference of the means
+ *        (Chan et al.), so no raw sample is needed
+ * @param to The bucket to fold into
+ * @param from The bucket to fold
  */
-time_t getStartOfDay (time_t ts) {
-    struct tm tm;
-    localtime_r (&ts, &tm);
-    tm.tm_sec = 0;
-    tm.tm_min = 0;
-    tm.tm_hour = 0;
-    time_t t = mktime(&tm);
-    return t;
+void foldBucket (rollupBucket *to, const rollupBucket *from) {
+    if (from->vcount == 0) {
+        return;
+    }
+    if (to->vcount == 0 || from->vmax > to->vmax) {
+        to->vmax = from->vmax;
+    }
+    if (to->vcount == 0 || from->vmin < to->vmin) {
+        to->vmin = from->vmin;
+    }
+    if (to->vcount == 0) {
+        to->vm2 = from->vm2;
+    } else {
+        double delta = from->vsum / from->vcount - to->vsum / to->vcount;
+        to->vm2 += from->vm2 + delta * delta * to->vcount * from->vcount / (to->vcount + from->vcount);
+    }
+    to->vsum += from->vsum;
+    to->vcount += from->vcount;
+    tdigestMerge(&to->sketch, &from->sketch);
 }
 
 /**
- * \brief Adjust the time stamp for the beginning of the hour
- * @param ts The time stamp
- * @return Adjusted time stamp
+ * \brief Fold a delta into a stored bucket, creating it if needed
+ *        The stored bucket is read back, folded with the delta and written
+ *        again, so sum, count, M2 and the sketch stay exact
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The roll up type. See enAggregationType
+ * @param ts The bucket start
+ * @param delta The aggregate of the new samples
+ * @return 0 if all good
  */
-time_t getStartOfHour (time_t ts) {
-    struct tm tm;
-    localtime_r (&ts, &tm);
-    tm.tm_min = 0;
-    tm.tm_sec = 0;
-    time_t t = mktime(&tm);
-    return t;
+int mergeRollup (rollupCtx *ctx, int64_t tagId, int type, time_t ts, const rollupBucket *delta) {
+    int64_t t = monotonicNanos();
+    rollupBucket b;
+    if (delta->vcount == 0) {
+        return SQLITE_OK;   // only missing samples, as applyJob no row is written
+    }
+    int rc = ctx->store->methods->xReadBucket(ctx->store, tagId, type, (int64_t)ts, &b);
+    if (rc != SQLITE_OK) {
+        ctx->metrics.sqliteErrors++;
+    } else {
+        foldBucket(&b, delta);
+        b.vavg = b.vsum / b.vcount;
+        rc = writeRollup(ctx, tagId, type, ts, &b);
+    }
+    metricsRecord(&ctx->metrics, METRIC_WRITE, monotonicNanos() - t);
+    return rc;
 }
 
 /**
- * \brief Update the JOB table
- * @param db The database connection
+ * \brief Perform the data aggregation
+ *        Folds sum, count, min, max, M2 and the sketch in one aggregate,
+ *        from the buckets of the child level or, for the finest level,
+ *        from the samples
+ * @param ctx The connection context
  * @param tagId The tag ID
- * @param type The aggregation type
- * @param utc The time stamp
- * @return 
+ * @param type The level being rolled up. See enAggregationType
+ * @param startTs Start period
+ * @param endTs Final period
+ * @param b The aggregated bucket, count is 0 if there was nothing to aggregate
+ * @return 0 if all good
  */
-int updateRollupControl (sqlite3 *db, int64_t tagId, int type, time_t utc) {
-    int rc;
-    const char *insert  = "insert into job (tagid, type, ts) values (%" PRId64 ",%d, %" PRId64 ");";;
-    char query[512];
-    
-    switch (type) {
-        case ROLLUP_HOUR:
-            utc = getStartOfHour(utc - 1);
-            break;
-        case ROLLUP_DAY:
-            utc = getStartOfDay(utc);
-            break;
-        case ROLLUP_MONTH:
-            utc = getStartOfMonth(utc);
-            break;
-        case ROLLUP_YEAR:
-            utc = getStartOfYear(utc);
-            break;
-        default:
-            return SQLITE_OK;
-            break;
+static int rollupTag (rollupCtx *ctx, int64_t tagId, int type, int64_t startTs, int64_t endTs, rollupBucket *b) {
+    rollupStore *s = ctx->store;
+    int64_t rows = 0;
+    memset(b, 0, sizeof (*b));
+    int rc = s->methods->xAggregate(s, tagId, levelGet(type)->child, startTs, endTs, b, &rows);
+    if (rc == SQLITE_OK) {
+        if (b->vcount > 0) {
+            b->vavg = b->vsum / b->vcount;
+        }
+        ctx->metrics.rowsRead[type] += rows;
+    } else {
+        ctx->metrics.sqliteErrors++;
     }
-    sprintf (query, insert, tagId, type, (int64_t)utc);
-    rc = execSql(db, query);
-    if (rc == SQLITE_CONSTRAINT) {
-        rc = SQLITE_OK;
+    return rc;    
+}
+
+/**
+ * \brief Compute the bucket a job stands for. Nothing is written
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param type The roll up type. See enAggregationType
+ * @param ts The job time stamp
+ * @param start The bucket start
+ * @param b The bucket, count is 0 if there was nothing to aggregate
+ * @return 0 if all good
+ */
+int computeJob (rollupCtx *ctx, int64_t tagId, int type, time_t ts, time_t *start, rollupBucket *b) {
+    if (levelGet(type) == NULL) {
+        return SQLITE_MISUSE;
     }
+    int64_t t = monotonicNanos();
+    *start = bucketStart(type, ts);
+    int rc = rollupTag(ctx, tagId, type, *start, bucketNext(type, *start), b);
+    metricsRecord(&ctx->metrics, METRIC_READ, monotonicNanos() - t);
     return rc;
 }
 
 /**
- * \brief Update the roll up table
- * @param db The data base connection
+ * \brief Store a computed bucket, retire its job and queue the levels above
+ * @param ctx The connection context
+ * @param id The job ID
  * @param tagId The tag ID
- * @param type The aggregation type
- * @param ts The time stamp
- * @param st The sql statement to extract the data from
- * @return 
+ * @param type The roll up type. See enAggregationType
+ * @param start The bucket start
+ * @param b The bucket
+ * @return 0 if all good
  */
-static int upsertRollup (sqlite3 *db, uint64_t tagId, int type, time_t ts, sqlite3_stmt *st) {
-    int rc;
-    char query[1024];
-    const char *insert = 
-    "insert into rollup "
-    "(tagid, type, vsum, vavg, vmax, vmin, vcount, ts) "
-    "values (%" PRId64 ", %d, %g, %g, %g, %g, %" PRId64 ", %" PRId64 ");";
-
-    const char *update = 
-    "update rollup "
-    "set "
-    "vsum=%g, "
-    "vavg=%g, "
-    "vmax=%g, "
-    "vmin=%g, "
-    "vcount=%" PRId64 " "
-    "where "
-    "tagid=%" PRId64 " and "
-    "type=%d and ts=%" PRId64 ";";
-    double vsum =    sqlite3_column_double (st, 0);
-    double vavg =    sqlite3_column_double (st, 1);
-    double vmax =    sqlite3_column_double (st, 2);
-    double vmin =    sqlite3_column_double (st, 3);
-    int64_t vcount = sqlite3_column_int64  (st, 4);
-    if (vcount == 0) {
-        return SQLITE_OK;
+int applyJob (rollupCtx *ctx, int64_t id, int64_t tagId, int type, time_t start, const rollupBucket *b) {
+    int rc = SQLITE_OK;
+    int64_t t = monotonicNanos();
+    if (b->vcount > 0) {
+        rc = writeRollup(ctx, tagId, type, start, b);
+        int64_t now = monotonicNanos();
+        metricsRecord(&ctx->metrics, METRIC_WRITE, now - t);
+        t = now;
     }
-    switch (type) {
-        case ROLLUP_HOUR:
-            ts = getStartOfHour (ts);
-            break;
-        case ROLLUP_DAY:
-            ts = getStartOfDay (ts);
-            break;
-        case ROLLUP_MONTH:
-            ts = getStartOfMonth (ts);
-            break;
-        case ROLLUP_YEAR:
-            ts = getStartOfYear (ts);
-            break;
+    if (rc == SQLITE_OK) {
+        rc = ctx->store->methods->xJobDelete(ctx->store, id);
     }
-    sprintf (query, insert, tagId, type, vsum, vavg, vmax, vmin, vcount, (int64_t)ts);
-    rc = execSql (db, query);
-    if (rc != SQLITE_OK) {
-        if (rc == SQLITE_CONSTRAINT) {
-            sprintf (query, update, vsum, vavg, vmax, vmin, vcount, tagId, type, (int64_t)ts);
-            rc = execSql (db, query);            
-        } else {
-            printf ("Error inserting rollup data\n");
+    if (rc == SQLITE_OK) {
+        int64_t now = monotonicNanos();
+        metricsRecord(&ctx->metrics, METRIC_JOB_DELETE, now - t);
+        const rollupLevel *level = levelGet(type);
+        int i;
+        for (i = 0; i < level->parentCount && rc == SQLITE_OK; i++) {
+            rc = updateRollupControl (ctx, tagId, level->parents[i], start);
+        }
+        if (level->parentCount > 0) {
+            metricsRecord(&ctx->metrics, METRIC_ENQUEUE, monotonicNanos() - now);
         }
     }
+    if (rc == SQLITE_OK) {
+        ctx->jobs++;
+    }
     return rc;
 }
 
 /**
- * \brief Perform the data aggregation
- *        Aggregates the data in five different flavors as in:
- *        MAX; MIN; AVERAGE; SUM and COUNT
- * @param db The database connection
- * @param tagId The tag ID
- * @param startTs Start period
- * @param endTs Final period
- * @param type Aggregation type 
+ * \brief Do one type of data roll up for the entire data set
+ *        Jobs are applied in batches of ctx->batchJobs jobs or
+ *        ctx->batchMillis milliseconds, unless the caller already opened
+ *        a transaction
+ * @param ctx The connection context
+ * @param type The roll up type. See enAggregationType
  * @return 0 if all good
  */
-static int rollupTag (sqlite3 *db, int64_t tagId, int64_t startTs, int64_t endTs, int type) {
+int rollup (rollupCtx *ctx, int type) {
+    return rollupSlice(ctx, type, 0, NULL);
+}
+
+/**
+ * \brief Roll up at most maxJobs jobs of one type
+ *        The jobs left over stay queued for the next call. With more than
+ *        one thread the whole level is rolled up whatever maxJobs is. With
+ *        ctx->watermark the watermarks of the level move on once its jobs
+ *        are all done
+ * @param ctx The connection context
+ * @param type The roll up type. See enAggregationType
+ * @param maxJobs The job limit, 0 for no limit
+ * @param done The jobs applied, may be NULL
+ * @return 0 if all good
+ */
+int rollupSlice (rollupCtx *ctx, int type, int maxJobs, int64_t *done) {
+    int64_t jobs = ctx->jobs;
     int rc = SQLITE_OK;
-    char query[2048];
-    const char *select = "select sum(vsum), avg(vavg), max(vmax), min(vmin), sum(vcount)"
-                        " from rollup "
-                        " where "
-                        " tagid =  %" PRId64 " and "
-                        " type = %d and "
-                        " ts >= %" PRId64 " and "
-                        " ts < %" PRId64 " ";
-    sprintf (query, select, tagId, type, startTs, endTs);
-    sqlite3_stmt *st = NULL;
-    rc = sqlite3_prepare_v2(db, query, (int)(strlen(query)), &st, NULL);
-    if (rc == SQLITE_OK) {
-        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
-            upsertRollup(db, tagId, type + 1, startTs, st);
+    if (levelGet(type) == NULL) {
+        return ~SQLITE_OK;
+    }
+    if ((rc = jobFlush(ctx)) != SQLITE_OK) {
+        return rc;
+    }
+    if (ctx->threads > 1) {
+        rc = rollupParallel(ctx, type);
+        if (rc == SQLITE_OK && ctx->watermark) {
+            rc = markAdvance(ctx, type);
         }
-        sqlite3_finalize(st);
-        if (rc == SQLITE_DONE) {
-            rc = SQLITE_OK;
+        if (done != NULL) {
+            *done = ctx->jobs - jobs;
         }
-    } else {
-        printf("%s - %s\n", sqlite3_errmsg(db), query);
+        return rc;
     }
-    return rc;    
+    rollupStore *s = ctx->store;
+    int batched = ctx->batchJobs > 0 && s->methods->xAutocommit(s);
+    if (batched && (rc = batchBegin(ctx)) != SQLITE_OK) {
+        return rc;
+    }
+    if ((rc = s->methods->xJobBegin(s, type)) != SQLITE_OK) {
+        return batched ? batchEnd(ctx, rc) : rc;
+    }
+    int64_t t = monotonicNanos();
+    storeJob job;
+    while ((rc = s->methods->xJobNext(s, &job)) == SQLITE_ROW) {
+        metricsRecord(&ctx->metrics, METRIC_JOB_FETCH, monotonicNanos() - t);
+        time_t ts = job.ts;
+        rollupBucket b;
+        rc = computeJob(ctx, job.tagId, type, ts, &ts, &b);
+        if (rc == SQLITE_OK) {
+            rc = applyJob(ctx, job.id, job.tagId, type, ts, &b);
+        }
+        if (rc != SQLITE_OK) {
+            break;      // the batch is rolled back below
+        }
+        if (batched && (rc = batchStep(ctx)) != SQLITE_OK) {
+            batched = 0;
+            break;
+        }
+        if (metricsDumpPending()) {
+            rollupBacklog(ctx);
+            metricsDump(&ctx->metrics, stdout);
+        }
+        if (maxJobs > 0 && ctx->jobs - jobs >= maxJobs) {
+            rc = SQLITE_DONE;
+            break;
+        }
+        t = monotonicNanos();
+    }
+    s->methods->xJobEnd(s);
+    if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+    }
+    if (batched) {
+        rc = batchEnd(ctx, rc);
+    }
+    // the late jobs go first, the watermark once they are all done
+    if (rc == SQLITE_OK && ctx->watermark && (maxJobs == 0 || ctx->jobs - jobs < maxJobs)) {
+        rc = markAdvance(ctx, type);
+    }
+    if (done != NULL) {
+        *done = ctx->jobs - jobs;
+    }
+    return rc;
 }
 
 /**
- * \brief Roll up data by year
- * @param db The database connection
- * @param tagId The tag ID
- * @param ts The year to be rolled up
+ * \brief Roll up every level, finest first
+ * @param ctx The connection context
  * @return 0 if all good
  */
-static int rollupTagByYear (sqlite3 *db, int64_t tagId, int64_t ts) {
+static int doRollup (rollupCtx *ctx) {
+    int64_t jobs = ctx->jobs;
+    int64_t commits = ctx->commits;
+    int64_t *backlog = ctx->metrics.backlog;
+    char message[64];
     int rc = SQLITE_OK;
-    time_t ts2 = timeAddYear(ts);
-    rc = rollupTag(db, tagId, ts, ts2, ROLLUP_MONTH);
+    int i;
+    if (rollupBacklog(ctx) == SQLITE_OK) {
+        printf ("Backlog:");
+        for (i = 0; i < levelCount(); i++) {
+            printf ("%s %" PRId64 " %s", i > 0 ? "," : "", backlog[levelAt(i)], levelName(levelAt(i)));
+        }
+        printf ("\n");
+    }
+    double start = monotonicSeconds();
+    for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+        rc = rollup(ctx, levelAt(i));
+        sprintf (message, "Rollup by %s done", levelName(levelAt(i)));
+        lap (message);
+    }
+    double elapsed = monotonicSeconds() - start;
+    jobs = ctx->jobs - jobs;
+    commits = ctx->commits - commits;
+    printf ("Statements prepared %" PRId64 ", reused %" PRId64 "\n",
+            ctx->stmtPrepared, ctx->stmtReused);
+    printf ("Job requests %" PRId64 ", coalesced %" PRId64 ", rows inserted %" PRId64 "\n",
+            ctx->jobRequests, ctx->jobCoalesced, ctx->jobRows);
+    if (ctx->watermark) {
+        printf ("Jobs left to the watermark %" PRId64 ", buckets rolled up past it %" PRId64 "\n",
+                ctx->jobsAhead, ctx->markBuckets);
+    }
+    printf ("Jobs %" PRId64 ", commits %" PRId64 " in %.3f seconds (%.0f jobs/s, %.0f commits/s)\n",
+            jobs, commits, elapsed, jobs / elapsed, commits / elapsed);
+    rollupBacklog(ctx);
+    metricsDump(&ctx->metrics, stdout);
     return rc;
 }
 
+/*
+ * Running accumulator of one level in the single pass engine
+ */
+typedef struct rollupAcc {
+    int open;
+    time_t ts;
+    time_t end;             // the next bucket start
+    rollupBucket b;
+} rollupAcc;
+
 /**
- * \brief Roll up data by month
- * @param db The database connection
+ * \brief Emit a finished bucket and fold it into the levels above
+ * @param ctx The connection context
  * @param tagId The tag ID
- * @param ts The month to be rolled up
+ * @param acc The accumulators of all levels
+ * @param type The level to be closed
  * @return 0 if all good
  */
-static int rollupTagByMonth (sqlite3 *db, int64_t tagId, int64_t ts) {
+static int closeBucket (rollupCtx *ctx, int64_t tagId, rollupAcc *acc, int type) {
+    rollupAcc *a = &acc[type];
     int rc = SQLITE_OK;
-    time_t ts2  = timeAddMonth(ts);
-    rc = rollupTag(db, tagId, ts, ts2, ROLLUP_DAY);
+    a->open = 0;
+    if (a->b.vcount == 0) {
+        return rc;      // only missing samples, as applyJob no row is written
+    }
+    a->b.vavg = a->b.vsum / a->b.vcount;
+    tdigestCompress(&a->b.sketch);     // the parent merges what gets stored
+    rc = writeRollup(ctx, tagId, type, a->ts, &a->b);
+    const rollupLevel *level = levelGet(type);
+    int i;
+    for (i = 0; i < level->parentCount; i++) {
+        foldBucket(&acc[level->parents[i]].b, &a->b);
+    }
     return rc;
 }
 
 /**
- * \brief Roll up data by day
- * @param db The database connection
+ * \brief Move the accumulators to a new bucket of the finest level,
+ *        closing every level whose bucket ends before it
+ *        Levels are visited finest first, so a bucket is folded into the
+ *        levels above before they close
+ * @param ctx The connection context
  * @param tagId The tag ID
- * @param ts The day to be rolled up
+ * @param acc The accumulators of all levels
+ * @param base The start of the new bucket of the finest level
  * @return 0 if all good
  */
-static int rollupTagByDay (sqlite3 *db, int64_t tagId, int64_t ts) {
+static int advanceBucket (rollupCtx *ctx, int64_t tagId, rollupAcc *acc, time_t base) {
     int rc = SQLITE_OK;
-    rc = rollupTag(db, tagId, ts, ts + (3600 * 24),ROLLUP_HOUR);
+    int i;
+    for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+        int type = levelAt(i);
+        time_t start = bucketStart(type, base);
+        if (acc[type].open && acc[type].ts == start) {
+            continue;
+        }
+        if (acc[type].open) {
+            rc = closeBucket(ctx, tagId, acc, type);
+        }
+        memset(&acc[type], 0, sizeof (acc[type]));
+        acc[type].open = 1;
+        acc[type].ts = start;
+        acc[type].end = bucketNext(type, start);
+    }
     return rc;
 }
 
 /**
- * \brief Roll up data by hour
- * @param db The database connection
+ * \brief Rebuild every roll up level of one tag in a single pass
+ *        The history is read once in time order while the accumulators of
+ *        every level run side by side. A bucket is written as soon as
+ *        the first sample past its end shows up, so each row is written once
+ * @param ctx The connection context
  * @param tagId The tag ID
- * @param ts The hour to be rolled up
+ * @param samples Incremented by the number of history rows read
  * @return 0 if all good
  */
-static int rollupTagByHour (sqlite3 *db, int64_t tagId, int64_t ts) {
+static int rebuildTag (rollupCtx *ctx, int64_t tagId, int64_t *samples) {
     int rc = SQLITE_OK;
-    char query[2048];
-    const char *select = "select sum(value), avg(value), max(value), min(value), count(value)"
-                        " from history "
-                        " where "
-                        " tagid = %" PRId64 " AND "
-                        " ts > %" PRId64 " and "
-                        " ts <= %" PRId64 " ";
-    sprintf (query, select, tagId, (int64_t)ts, (int64_t)ts + 3600);
-    sqlite3_stmt *st = NULL;
-    rc = sqlite3_prepare_v2(db, query, (int)(strlen(query)), &st, NULL);
-    if (rc == SQLITE_OK) {
-        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
-            upsertRollup(db, tagId, ROLLUP_HOUR, ts, st);
+    rollupAcc acc[ROLLUP_LEVELS];
+    valueBuffer *v = &ctx->values;
+    int base = levelAt(0);
+    int i;
+    memset(acc, 0, sizeof (acc));
+    v->count = 0;
+    v->rc = SQLITE_OK;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_ROLLUP_DELETE_TAG);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    if ((rc = stmtExec(ctx, st)) != SQLITE_OK) {
+        return rc;
+    }
+    blockIter it;
+    int64_t sampleTs;
+    double value;
+    if (ctx->columnar) {
+        st = NULL;
+        if ((rc = blockIterBegin(ctx, &it, tagId, INT64_MIN, INT64_MAX)) != SQLITE_OK) {
+            return rc;
         }
-        sqlite3_finalize(st);
-        if (rc == SQLITE_DONE) {
-            rc = SQLITE_OK;
+    } else if ((st = stmtGet(ctx, STMT_HISTORY_SCAN)) == NULL) {
+        return SQLITE_ERROR;
+    } else {
+        sqlite3_bind_int64 (st, 1, tagId);
+    }
+    while ((rc = st == NULL ? blockIterNext(&it, &sampleTs, &value) : sqlite3_step(st)) == SQLITE_ROW) {
+        if (st != NULL) {
+            sampleTs = sqlite3_column_int64(st, 0);
+            value = sqlite3_column_type(st, 1) == SQLITE_NULL ? NAN : sqlite3_column_double(st, 1);
+        }
+        time_t ts = (time_t)sampleTs;
+        rollupAcc *h = &acc[base];
+        // a bucket holds (start, end], as in rollupTag
+        if (!h->open || ts <= h->ts || ts > h->end) {
+            foldValues(&h->b, v->values, v->count);
+            v->count = 0;
+            if ((rc = advanceBucket(ctx, tagId, acc, bucketStart(base, ts - 1))) != SQLITE_OK) {
+                break;
+            }
         }
+        valuePush(v, value);
+        (*samples)++;
+    }
+    foldValues(&acc[base].b, v->values, v->count);
+    v->count = 0;
+    if (rc == SQLITE_DONE && v->rc != SQLITE_OK) {
+        rc = v->rc;
+    }
+    if (st == NULL) {
+        blockIterEnd(&it);
     } else {
-        printf ("%s - %s\n", sqlite3_errmsg(db), query);
+        sqlite3_reset(st);
+    }
+    if (rc != SQLITE_DONE) {
+        return rc;
+    }
+    rc = SQLITE_OK;
+    for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+        if (acc[levelAt(i)].open) {
+            rc = closeBucket(ctx, tagId, acc, levelAt(i));
+        }
+    }
+    if (rc == SQLITE_OK) {
+        // everything this tag was waiting for is now up to date
+        st = stmtGet(ctx, STMT_JOB_DELETE_TAG);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64 (st, 1, tagId);
+        rc = stmtExec(ctx, st);
     }
     return rc;
 }
 
 /**
- * \brief Do one type of data roll up for the entire data set
- * @param db The database connection
- * @param type The roll up type. See enAggregationType
+ * \brief Rebuild all roll up levels of every tag with the single pass engine
+ *        Each tag is rebuilt in its own transaction unless the caller
+ *        already opened one
+ * @param ctx The connection context
  * @return 0 if all good
  */
-static int rollup (sqlite3 *db, int type) {
+static int doRebuild (rollupCtx *ctx) {
     int rc = SQLITE_OK;
-    int nextRollup;
-    char query[1024];
-    const char *select = "select "
-                         "id,"
-                         "tagid,"
-                         "ts "
-                         "from job "
-                         "where "
-                         "type = %d "
-                         "order by tagid, ts";
-    switch (type) {
-        case ROLLUP_HOUR:   // we move to local time when coming from history
-            nextRollup = ROLLUP_DAY;
-            break;
-        case ROLLUP_DAY:
-            nextRollup = ROLLUP_MONTH;
-            break;
-        case ROLLUP_MONTH:
-            nextRollup = ROLLUP_YEAR;
+    int64_t tags = 0;
+    int64_t samples = 0;
+    double start = monotonicSeconds();
+    // the rebuild drops the jobs of every tag it touches
+    if ((rc = jobFlush(ctx)) != SQLITE_OK) {
+        return rc;
+    }
+    jobForget(ctx);
+    sqlite3_stmt *st = stmtGet(ctx, ctx->columnar ? STMT_TAG_SELECT_BLOCK : STMT_TAG_SELECT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    int batched = sqlite3_get_autocommit(ctx->db);
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        int64_t tagId = sqlite3_column_int64(st, 0);
+        if (batched && (rc = batchBegin(ctx)) != SQLITE_OK) {
             break;
-        case ROLLUP_YEAR:
-            nextRollup = -1;
+        }
+        rc = rebuildTag(ctx, tagId, &samples);
+        if (batched) {
+            rc = batchEnd(ctx, rc);
+        }
+        if (rc != SQLITE_OK) {
             break;
-        default:
-            return ~SQLITE_OK;
-    }
-
-    sprintf (query, select, type);
-    sqlite3_stmt *st = NULL;
-    rc = sqlite3_prepare_v2(db, query, (int)(strlen(query)), &st, NULL);
-    if (rc == SQLITE_OK) {
-        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
-            int64_t id =        sqlite3_column_int64 (st, 0);
-            int64_t tagId =     sqlite3_column_int64 (st, 1);
-            uint64_t ts =       sqlite3_column_int64 (st, 2);
-            switch (type) {
-                case ROLLUP_HOUR:
-                    ts = getStartOfHour(ts);
-                    rc = rollupTagByHour  (db, tagId, ts);
-                    break;
-                case ROLLUP_DAY:
-                    ts = getStartOfDay(ts);
-                    rc = rollupTagByDay   (db, tagId, ts);
-                    break;
-                case ROLLUP_MONTH:
-                    ts = getStartOfMonth(ts);
-                    rc = rollupTagByMonth (db, tagId, ts);
-                    break;
-                case ROLLUP_YEAR:
-                    ts = getStartOfYear(ts);
-                    rc = rollupTagByYear  (db, tagId, ts);
-                    break;            
-            }
-            if (rc == SQLITE_OK) {
-                const char *delete = "delete from job where id = %" PRId64 ";";
-                sprintf (query, delete, id);
-                execSql (db, query);
-                if (nextRollup != -1) {
-                    updateRollupControl (db, tagId, nextRollup, ts);
-                }
-            }
         }
-        sqlite3_finalize(st);
-    } else {
-        printf ("%s - %s\n", sqlite3_errmsg(db), query);
+        tags++;
     }
+    sqlite3_reset(st);
     if (rc == SQLITE_DONE) {
         rc = SQLITE_OK;
     }
+    double elapsed = monotonicSeconds() - start;
+    printf ("Rebuild %" PRId64 " tags, %" PRId64 " samples in %.3f seconds (%.0f samples/s)\n",
+            tags, samples, elapsed, samples / elapsed);
     return rc;
 }
 
 /**
- * \brief Roll up up data by hour; day; month and year
- * @param db The database connection
- * @return 0 if all good
+ * \brief Compare the single pass engine against the job based roll up
+ *        Both run over the same data, doRollup being the reference
+ * @param ctx The connection context
+ * @return 0 if both produced the same rows
  */
-static int doRollup (sqlite3 *db) {
-    int rc = rollup(db, ROLLUP_HOUR);
-    lap ("Hourly rollup done");
+static int checkRebuild (rollupCtx *ctx) {
+    const char *columns = "tagid, type, ts, vsum, vavg, vmax, vmin, vcount, sketch, vm2, vstddev";
+    char query[512];
+    int rc = doRollup(ctx);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    execSql (ctx->db, "drop table if exists temp.reference;");
+    sprintf (query, "create temp table reference as select %s from rollup;", columns);
+    if ((rc = execSql(ctx->db, query)) != SQLITE_OK) {
+        return rc;
+    }
+    if ((rc = doRebuild(ctx)) != SQLITE_OK) {
+        return rc;
+    }
+    sprintf (query, "select count(*) from ("
+                    "select %s from reference except select %s from rollup "
+                    "union all "
+                    "select %s from rollup except select %s from reference);",
+             columns, columns, columns, columns);
+    sqlite3_stmt *st = NULL;
+    rc = sqlite3_prepare_v2(ctx->db, query, -1, &st, NULL);
     if (rc == SQLITE_OK) {
-        rc = rollup(db, ROLLUP_DAY);
-        lap ("Daily rollup done");
-        if (rc == SQLITE_OK) {
-            rc = rollup(db, ROLLUP_MONTH);
-            lap ("Monthly rollup done");
-            if (rc == SQLITE_OK) {
-                rc = rollup(db, ROLLUP_YEAR);
-                lap ("Yearly rollup done");
-            }
+        int64_t diff = -1;
+        if (sqlite3_step(st) == SQLITE_ROW) {
+            diff = sqlite3_column_int64(st, 0);
         }
+        sqlite3_finalize(st);
+        printf ("Single pass vs reference: %" PRId64 " rows differ\n", diff);
+        rc = diff == 0 ? SQLITE_OK : SQLITE_MISMATCH;
+    } else {
+        printf ("%s - %s\n", sqlite3_errmsg(ctx->db), query);
     }
     return rc;
 }
@@ -512,55 +1152,561 @@ static int doRollup (sqlite3 *db) {
  * \Brief Populates the data base with initial data to be rolled
  *        A good idea is to create data interval with value 1 (one) so it's easy to
  *        predict the results
- * @param db Database connection
+ * @param ctx The connection context
  * @param startDate The start date in ISODate 8601
  * @param endDate The final date in ISODate format
  * @param timeInterval The data frequency in one hour, like 15 for one data every quarter hour
  * @param tagId The Tag ID
  * @param value The tag value
  */
-static void generateSampleData (sqlite3 *db, const char *startDate, const char *endDate, int timeInterval, int tagId, double value) {
-    const char *insert = "insert into history (tagid, value, ts) "
-        "values (%d, %g, %" PRId64 ");";
+static void generateSampleData (rollupCtx *ctx, const char *startDate, const char *endDate, int timeInterval, int tagId, double value) {
     char query[1024];
     time_t sd = iso8602ts (startDate);
     time_t ed = iso8602ts (  endDate);
     const char *newTag = "insert into tag (id, name) values (%d, 'TAG%d');";
     sprintf (query, newTag, tagId, tagId);
-    execSql (db, query);
-    execSql (db, "begin;");
+    execSql (ctx->db, query);
+    rollupSample samples[4096];
+    int count = 0;
     for (;sd <= ed; sd += timeInterval) {
-        sprintf (query, insert, tagId, value, (int64_t)sd, (int64_t)sd, (int64_t)sd);
-        execSql (db, query);
-        updateRollupControl (db, 1, ROLLUP_HOUR, sd);
+        samples[count].tagId = tagId;
+        samples[count].ts = sd;
+        samples[count].value = value;
+        if (++count == (int)(sizeof (samples) / sizeof (samples[0]))) {
+            ingestSamples (ctx, samples, count);
+            count = 0;
+        }
     }
-    execSql (db, "commit;");
+    ingestSamples (ctx, samples, count);
+}
+
+/**
+ * \brief Bring an older database up to the current schema
+ *        Every step checks before it changes anything, so it can run on
+ *        every start
+ * @param db The database connection
+ * @return 0 if all good
+ */
+int ensureSchema (sqlite3 *db) {
+    static const struct {
+        const char *probe;
+        const char *change;
+    } steps[] = {
+        {"select sketch from rollup limit 0;",  "alter table rollup add column sketch blob;"},
+        {"select vm2 from rollup limit 0;",     "alter table rollup add column vm2 real;"},
+        {"select vstddev from rollup limit 0;", "alter table rollup add column vstddev real;"},
+        {"select t0 from historyblock limit 0;",
+         "create table HistoryBlock ("
+         "  TagId integer NOT NULL,"
+         "  t0    integer NOT NULL,"   // first sample
+         "  t1    integer NOT NULL,"   // last sample
+         "  count integer NOT NULL,"
+         "  data  blob NOT NULL,"
+         "  PRIMARY KEY (TagId, t0)"
+         ") WITHOUT ROWID;"},
+        {"select keepdays from retentionpolicy limit 0;",
+         "create table RetentionPolicy ("
+         "  TagId    integer NOT NULL,"   // 0 for every tag
+         "  Type     integer NOT NULL,"   // -1 for the raw samples
+         "  KeepDays integer NOT NULL,"
+         "  PRIMARY KEY (TagId, Type)"
+         ") WITHOUT ROWID;"},
+        {"select ts from watermark limit 0;",
+         "create table Watermark ("
+         "  Type  integer NOT NULL,"
+         "  TagId integer NOT NULL,"
+         "  ts    integer NOT NULL,"   // the first bucket not rolled up yet
+         "  PRIMARY KEY (Type, TagId)"
+         ") WITHOUT ROWID;"},
+        {"select value from setting limit 0;",
+         "create table Setting ("
+         "  Name  text NOT NULL,"     // levels or watermark, see settingsLoad
+         "  Value text NOT NULL,"
+         "  PRIMARY KEY (Name)"
+         ") WITHOUT ROWID;"}
+    };
+    int rc = SQLITE_OK;
+    size_t i;
+    for (i = 0; i < sizeof (steps) / sizeof (steps[0]) && rc == SQLITE_OK; i++) {
+        sqlite3_stmt *st = NULL;
+        if (sqlite3_prepare_v2(db, steps[i].probe, -1, &st, NULL) == SQLITE_OK) {
+            sqlite3_finalize(st);
+            continue;
+        }
+        rc = execSql(db, steps[i].change);
+    }
+    return rc;
+}
+
+/**
+ * \brief Run a query that yields at most one text value
+ * @param db The database connection
+ * @param sql The query
+ * @param value Filled with the value, empty if no row
+ * @param size Its size
+ * @return SQLITE_ROW if found, SQLITE_DONE if not, an error otherwise
+ */
+static int queryText (sqlite3 *db, const char *sql, char *value, int size) {
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &st, NULL);
+    value[0] = '\0';
+    if (rc != SQLITE_OK) {
+        printf ("%s\n", sqlite3_errmsg(db));
+        return rc;
+    }
+    rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW && sqlite3_column_text(st, 0) != NULL) {
+        snprintf (value, size, "%s", (const char *)sqlite3_column_text(st, 0));
+    }
+    sqlite3_finalize(st);
+    return rc;
+}
+
+/**
+ * \brief Configure the levels and the watermark mode from the database
+ *        Every process rolling up a database must agree on both, so the
+ *        first one to run stores them in Setting and the others follow.
+ *        The watermark mode stays on once a database is in it
+ * @param ctx The connection context
+ * @param levels Comma separated level names, NULL for the stored ones or
+ *        hour,day,month,year on a new database
+ * @param watermark Non zero to switch the watermark mode on
+ * @return 0 if all good, SQLITE_MISUSE if the levels do not match the data
+ */
+int settingsLoad (rollupCtx *ctx, const char *levels, int watermark) {
+    char stored[256], list[256], value[32];
+    int rc = queryText(ctx->db, "select value from setting where name = 'levels';", stored, sizeof (stored));
+    int found = rc == SQLITE_ROW;
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        return rc;
+    }
+    if ((rc = levelConfigure(levels != NULL || !found ? levels : stored)) != SQLITE_OK) {
+        return rc;
+    }
+    levelList(list, sizeof (list));
+    if (found && strcmp(stored, list) != 0) {
+        rc = queryText(ctx->db, "select 1 from rollup union all select 1 from job limit 1;", value, sizeof (value));
+        if (rc == SQLITE_ROW) {
+            printf ("The database is rolled up to %s, not %s\n", stored, list);
+            return SQLITE_MISUSE;
+        }
+        if (rc != SQLITE_DONE) {
+            return rc;
+        }
+        found = 0;
+    }
+    // a database from before Setting may hold jobs or watermarks of other levels
+    sqlite3_stmt *st = NULL;
+    rc = sqlite3_prepare_v2(ctx->db, "select type from job union select type from watermark;", -1, &st, NULL);
+    while (rc == SQLITE_OK && sqlite3_step(st) == SQLITE_ROW) {
+        if (levelGet(sqlite3_column_int(st, 0)) == NULL) {
+            printf ("The database has jobs or watermarks of level %s, not one of %s\n",
+                    levelName(sqlite3_column_int(st, 0)), list);
+            rc = SQLITE_MISUSE;
+        }
+    }
+    sqlite3_finalize(st);
+    if (rc == SQLITE_OK && !found) {
+        char sql[320];
+        sqlite3_snprintf (sizeof (sql), sql, "insert or replace into setting values ('levels', %Q);", list);
+        rc = execSql(ctx->db, sql);
+    }
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    // watermarks from before Setting put the database in the mode as well
+    rc = queryText(ctx->db, "select value from setting where name = 'watermark';", value, sizeof (value));
+    found = rc == SQLITE_ROW && atoi(value) != 0;
+    if (rc == SQLITE_DONE && !watermark) {
+        rc = queryText(ctx->db, "select 1 from watermark limit 1;", value, sizeof (value));
+        watermark = rc == SQLITE_ROW;
+    }
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        return rc;
+    }
+    ctx->watermark = found || watermark;
+    if (ctx->watermark && !found) {
+        return execSql(ctx->db, "insert or replace into setting values ('watermark', '1');");
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Print the median, p95 and p99 of every bucket of one level
+ * @param ctx The connection context
+ * @param type The level. See enAggregationType
+ * @return 0 if all good
+ */
+static int printQuantiles (rollupCtx *ctx, int type) {
+    sqlite3_stmt *st = NULL;
+    char dt[32];
+    int rc = sqlite3_prepare_v2(ctx->db,
+            "select tagid, ts, vcount, rollup_quantile(sketch, 0.5),"
+            " rollup_quantile(sketch, 0.95), rollup_quantile(sketch, 0.99)"
+            " from rollup where type = ?1 order by tagid, ts;", -1, &st, NULL);
+    if (rc != SQLITE_OK) {
+        printf ("%s\n", sqlite3_errmsg(ctx->db));
+        return rc;
+    }
+    sqlite3_bind_int (st, 1, type);
+    printf ("%8s %-20s %10s %12s %12s %12s\n", "tag", "start", "count", "p50", "p95", "p99");
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        printf ("%8" PRId64 " %-20s %10" PRId64 " %12g %12g %12g\n",
+                (int64_t)sqlite3_column_int64(st, 0), tt2iso8602(sqlite3_column_int64(st, 1), dt),
+                (int64_t)sqlite3_column_int64(st, 2), sqlite3_column_double(st, 3),
+                sqlite3_column_double(st, 4), sqlite3_column_double(st, 5));
+    }
+    sqlite3_finalize(st);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Print the aggregate of one tag over a time range
+ * @param ctx The connection context
+ * @param tagId The tag ID
+ * @param from Range start in ISO 8601, UTC, excluded
+ * @param to Range end in ISO 8601, UTC, included
+ * @return 0 if all good
+ */
+static int printRange (rollupCtx *ctx, int64_t tagId, const char *from, const char *to) {
+    rollupQuery q;
+    memset(&q, 0, sizeof (q));
+    q.tagId = tagId;
+    q.from = iso8602ts(from);
+    q.to = iso8602ts(to);
+    int64_t t = monotonicNanos();
+    int rc = queryRange(ctx, &q);
+    t = monotonicNanos() - t;
+    if (rc != SQLITE_OK) {
+        printf ("Query failed with error %d\n", rc);
+        return rc;
+    }
+    printf ("Tag %" PRId64 " (%s, %s]: count %" PRId64 ", sum %g, avg %g, min %g, max %g, stddev %g\n",
+            tagId, from, to, q.b.vcount, q.b.vsum, q.b.vavg, q.b.vmin, q.b.vmax,
+            q.b.vcount > 1 ? sqrt(q.b.vm2 / (q.b.vcount - 1)) : 0);
+    if (q.b.vcount > 0 && q.b.sketch.weight == q.b.vcount) {
+        printf ("p50 %g, p95 %g, p99 %g\n", tdigestQuantile(&q.b.sketch, 0.5),
+                tdigestQuantile(&q.b.sketch, 0.95), tdigestQuantile(&q.b.sketch, 0.99));
+    }
+    printf ("Read %" PRId64 " buckets and %" PRId64 " samples in %.3f ms\n",
+            q.bucketsRead, q.samplesRead, t / 1e6);
+    return rc;
+}
+
+/**
+ * \brief Purge what the retention policies keep no more and print the counts
+ * @param ctx The connection context
+ * @param now The current time in ISO 8601, UTC, NULL for the clock
+ * @return 0 if all good
+ */
+static int printRetention (rollupCtx *ctx, const char *now) {
+    retentionStats stats;
+    int i;
+    int64_t t = monotonicNanos();
+    int rc = retentionRun(ctx, now != NULL ? iso8602ts(now) : time(NULL), &stats);
+    t = monotonicNanos() - t;
+    if (rc != SQLITE_OK) {
+        printf ("Retention failed with error %d\n", rc);
+    }
+    printf ("Retention over %d tags in %.3f seconds, %" PRId64 " transactions\n", stats.tags, t / 1e9, stats.chunks);
+    for (i = -1; i < levelCount(); i++) {
+        int type = i < 0 ? ROLLUP_RAW : levelAt(i);
+        printf ("  %-7s %" PRId64 " rows deleted\n", levelName(type), stats.deleted[type - ROLLUP_RAW]);
+    }
+    if (stats.held > 0 || stats.uncovered > 0) {
+        printf ("  %d levels held back by pending jobs, %d not rolled up\n", stats.held, stats.uncovered);
+    }
+    if (stats.unvacuumed) {
+        printf ("  Purged pages kept in the file, auto_vacuum is not INCREMENTAL, see retention-vacuum\n");
+    }
+    return rc;
+}
+
+/**
+ * \brief Remove all data from the database
+ * @param db The database connection
+ */
+void resetDatabase (sqlite3 *db) {
+    execSql (db, "delete from history;");
+    execSql (db, "delete from rollup;");
+    execSql (db, "delete from tag;");
+    execSql (db, "delete from job;");        
+    execSql (db, "delete from historyblock;");
+    execSql (db, "delete from watermark;");
+}
+
+/**
+ * \brief Compare the two upsert flavors on a re-rollup heavy workload
+ *        Every hour that was already rolled up is queued again, so each
+ *        bucket write hits an existing row at every level. Each pass runs
+ *        in one transaction so the numbers measure statement cost rather
+ *        than commit cost
+ * @param ctx The connection context
+ * @param passes How many times the full data set is rolled up again
+ * @return 0 if all good
+ */
+static int benchUpsert (rollupCtx *ctx, int passes) {
+    static const char *names[] = {"two-step", "native"};
+    int rc = SQLITE_OK;
+    int mode, pass, i;
+    char requeue[128];
+    resetDatabase (ctx->db);
+    generateSampleData(ctx,"2009-12-31T20:00:00", "2011-01-01T03:15:00", 900, 1, 1);
+    for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+        rc = rollup(ctx, levelAt(i));
+    }
+    sprintf (requeue, "insert or ignore into job (tagid, type, ts) "
+                      "select tagid, %d, ts from rollup where type = %d;", levelAt(0), levelAt(0));
+    for (mode = UPSERT_TWO_STEP; mode <= UPSERT_NATIVE && rc == SQLITE_OK; mode++) {
+        ctx->upsertMode = mode;
+        double elapsed = 0;
+        for (pass = 0; pass < passes && rc == SQLITE_OK; pass++) {
+            execSql (ctx->db, requeue);
+            double start = monotonicSeconds();
+            execSql (ctx->db, "begin;");
+            for (i = 0; i < levelCount() && rc == SQLITE_OK; i++) {
+                rc = rollup(ctx, levelAt(i));
+            }
+            execSql (ctx->db, "commit;");
+            elapsed += monotonicSeconds() - start;
+        }
+        if (ctx->upsertMode != mode) {
+            printf ("Upsert %s not supported by SQLite %s\n", names[mode], sqlite3_libversion());
+            continue;
+        }
+        printf ("Upsert %s: %d passes in %.3f seconds (%.3f per pass)\n",
+                names[mode], passes, elapsed, elapsed / passes);
+    }
+    return rc;
+}
+
+/**
+ * \brief Print the command line help
+ * @param name The program name
+ */
+static void usage (const char *name) {
+    fprintf (stderr,
+        "Usage: %s [options] [command]\n"
+        "Options:\n"
+        "  -b jobs    Jobs per transaction, 0 for autocommit (%d)\n"
+        "  -t millis  Max milliseconds a transaction stays open (%d)\n"
+        "  -j threads Roll up workers (1)\n"
+        "  -n tags    Tags in the generated sample data (1)\n"
+        "  -i secs    Sample interval of the bench workload (900)\n"
+        "  -s date    First sample of the bench workload (2010-01-01T00:00:00)\n"
+        "  -e date    Last sample of the bench workload (2011-01-01T00:00:00)\n"
+        "  -l ratio   Share of late samples in the bench workload (0.01)\n"
+        "  -r runs    Repeats of the bench workload (5)\n"
+        "  -I         Merge ingested samples straight into their hour\n"
+        "  -C         Keep raw samples in compressed blocks instead of History\n"
+        "  -W         Queue jobs only for data behind the watermarks, roll up the\n"
+        "             rest by moving them. The database stays in this mode, on every\n"
+        "             later run too\n"
+        "  -B backend Storage backend, sqlite or memory (sqlite)\n"
+        "  -L levels  Roll up levels, a comma separated list of minute, 15min, hour,\n"
+        "             day, week, month, quarter and year. Stored in the database,\n"
+        "             which keeps them once rolled up (hour,day,month,year)\n"
+        "Commands:\n"
+        "  rollup                 Roll up the pending jobs (default)\n"
+        "  rebuild                Roll up with the single pass engine instead of the jobs\n"
+        "  daemon [tick] [slice]  Keep rolling up the jobs as they come, on the existing\n"
+        "                         data, until SIGTERM. Wakes up on every commit of another\n"
+        "                         connection or every tick seconds (%d), rolls up at most\n"
+        "                         slice jobs at a time (%d, 0 for no limit)\n"
+        "  check-rebuild          Run both engines and compare their output\n"
+        "  bench-upsert [passes]  Compare the upsert flavors\n"
+        "  bench-calendar [count] Compare the calendar functions against libc\n"
+        "  bench-kernel [count]   Measure the aggregation kernels over count samples\n"
+        "  bench-ingest [samples] Measure the bulk ingest rate over -n tags\n"
+        "  bench                  Time every stage of the workload, JSON lines\n"
+        "  quantiles [level]      Print p50, p95 and p99 of a level (day)\n"
+        "  query tag from to      Aggregate a tag over (from, to], ISO 8601 UTC, from the\n"
+        "                         fewest roll up rows\n"
+        "  retention [now]        Purge what the retention policies keep no more\n"
+        "  retention-set tag level days\n"
+        "                         Keep a level, or raw, for days; tag 0 for all tags,\n"
+        "                         days all to keep it all\n"
+        "  retention-vacuum       Switch the database to incremental vacuum, once, so\n"
+        "                         retention gives the purged pages back\n",
+        name, BATCH_JOBS_DEFAULT, BATCH_MILLIS_DEFAULT, DAEMON_TICK_DEFAULT, DAEMON_SLICE_DEFAULT);
 }
 
 /**
  * \brief Data rollup with domino effect
  *        Details at http://tangerino.me/rollup.html
+ *        See usage() for the command line
  * @param argc
  * @param argv
  * @return 
  */
 int main (int argc, char *argv[]) {
     sqlite3 *db;
+    rollupCtx ctx;
+    int batchJobs = BATCH_JOBS_DEFAULT;
+    int batchMillis = BATCH_MILLIS_DEFAULT;
+    int threads = 1;
+    int tags = 1;
+    int incremental = 0;
+    int columnar = 0;
+    int watermark = 0;
+    const char *backend = "sqlite";
+    const char *levels = NULL;
+    benchConfig bench = {1, 900, "2010-01-01T00:00:00", "2011-01-01T00:00:00", 0.01, 5};
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:j:n:i:s:e:l:r:ICWB:L:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batchJobs = atoi(optarg);
+                break;
+            case 't':
+                batchMillis = atoi(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'n':
+                tags = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'i':
+                bench.interval = atoi(optarg) > 0 ? atoi(optarg) : 900;
+                break;
+            case 's':
+                bench.startDate = optarg;
+                break;
+            case 'e':
+                bench.endDate = optarg;
+                break;
+            case 'l':
+                bench.lateRatio = atof(optarg);
+                break;
+            case 'r':
+                bench.repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'I':
+                incremental = 1;
+                break;
+            case 'C':
+                columnar = 1;
+                break;
+            case 'W':
+                watermark = 1;
+                break;
+            case 'B':
+                backend = optarg;
+                break;
+            case 'L':
+                levels = optarg;
+                break;
+            default:
+                usage (argv[0]);
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (levelConfigure(levels) != SQLITE_OK) {
+        return 1;
+    }
+    if (argc > 0 && strcmp(argv[0], "bench-calendar") == 0) {
+        calendarBench(argc > 1 ? atoi(argv[1]) : 1000000);
+        return 0;
+    }
+    if (argc > 0 && strcmp(argv[0], "bench-kernel") == 0) {
+        kernelBench(argc > 1 ? atoi(argv[1]) : 4194304);
+        return 0;
+    }
     int rc = sqlite3_open("./testdb.db3", &db);
-    elapsedControl = time(NULL);
+    elapsedControl = monotonicNanos();
+    metricsInstall();
     if (rc == SQLITE_OK) {
+        rollupCtxInit (&ctx, db);
+        ctx.batchJobs = batchJobs;
+        ctx.batchMillis = batchMillis;
+        ctx.threads = threads;
+        ctx.incremental = incremental;
+        ctx.columnar = columnar;
         execSql (db, "PRAGMA journal_mode=WAL;");
-        lap ("Start process");
-        execSql (db, "delete from history;");
-        execSql (db, "delete from rollup;");
-        execSql (db, "delete from tag;");
-        execSql (db, "delete from job;");        
-        generateSampleData(db,"2009-12-31T20:00:00", "2011-01-01T03:15:00", 900, 1, 1);
-        //generateSampleData(db,"2010-01-01T00:00:00", "2014-01-01T02:00:00", 900, 2, -1);
-        lap ("Simulated data done");
-        doRollup(db);
-        lap ("Rollup done");
+        ensureSchema (db);
+        rc = settingsLoad(&ctx, levels, watermark);
+        if (strcmp(backend, "sqlite") != 0) {
+            if (ctx.store != NULL) {
+                ctx.store->methods->xClose(ctx.store);
+            }
+            ctx.store = storeOpen(&ctx, backend);
+            const char *command = argc > 0 ? argv[0] : "rollup";
+            if (ctx.store == NULL) {
+                printf ("Unknown storage backend %s\n", backend);
+                rc = SQLITE_MISUSE;
+            } else if (strcmp(command, "rollup") != 0 && strcmp(command, "bench") != 0 &&
+                       strcmp(command, "bench-ingest") != 0) {
+                printf ("%s needs the sqlite backend\n", command);
+                rc = SQLITE_MISUSE;
+            } else if (ctx.threads > 1) {
+                printf ("Parallel roll up needs the sqlite backend, running one thread\n");
+                ctx.threads = 1;
+            }
+        }
+        if (rc != SQLITE_OK) {
+            // bad settings or backend, nothing to run
+        } else if (argc > 0 && strcmp(argv[0], "bench-upsert") == 0) {
+            rc = benchUpsert(&ctx, argc > 1 ? atoi(argv[1]) : 3);
+        } else if (argc > 0 && strcmp(argv[0], "bench-ingest") == 0) {
+            ctx.store->methods->xReset(ctx.store);
+            rc = ingestBench(&ctx, argc > 1 ? atoll(argv[1]) : 1000000, tags);
+        } else if (argc > 3 && strcmp(argv[0], "query") == 0) {
+            rc = printRange(&ctx, atoll(argv[1]), argv[2], argv[3]);
+        } else if (argc > 0 && strcmp(argv[0], "retention") == 0) {
+            rc = printRetention(&ctx, argc > 1 ? argv[1] : NULL);
+        } else if (argc > 0 && strcmp(argv[0], "retention-vacuum") == 0) {
+            rc = retentionVacuum(&ctx);
+        } else if (argc > 3 && strcmp(argv[0], "retention-set") == 0) {
+            int type;
+            if (levelByName(argv[2], &type) != SQLITE_OK) {
+                printf ("Unknown level %s\n", argv[2]);
+                rc = SQLITE_MISUSE;
+            } else {
+                rc = retentionSet(&ctx, atoll(argv[1]), type, strcmp(argv[3], "all") == 0 ? -1 : atoi(argv[3]));
+            }
+        } else if (argc > 0 && strcmp(argv[0], "quantiles") == 0) {
+            int type = ROLLUP_DAY;
+            if (argc > 1 && (levelByName(argv[1], &type) != SQLITE_OK || type == ROLLUP_RAW)) {
+                printf ("Unknown level %s\n", argv[1]);
+                rc = SQLITE_MISUSE;
+            } else {
+                rc = printQuantiles(&ctx, type);
+            }
+        } else if (argc > 0 && strcmp(argv[0], "daemon") == 0) {
+            daemonConfig daemon = {DAEMON_TICK_DEFAULT, DAEMON_SLICE_DEFAULT};
+            if (argc > 1) {
+                daemon.tick = atoi(argv[1]) > 0 ? atoi(argv[1]) : DAEMON_TICK_DEFAULT;
+            }
+            if (argc > 2) {
+                daemon.slice = atoi(argv[2]) > 0 ? atoi(argv[2]) : 0;
+            }
+            rc = daemonRun(&ctx, &daemon);
+        } else if (argc > 0 && strcmp(argv[0], "bench") == 0) {
+            bench.tags = tags;
+            rc = benchRun(&ctx, &bench);
+        } else {
+            lap ("Start process");
+            ctx.store->methods->xReset(ctx.store);
+            int tagId;
+            for (tagId = 1; tagId <= tags; tagId++) {
+                generateSampleData(&ctx,"2009-12-31T20:00:00", "2011-01-01T03:15:00", 900, tagId, 1);
+            }
+            //generateSampleData(&ctx,"2010-01-01T00:00:00", "2014-01-01T02:00:00", 900, 2, -1);
+            lap ("Simulated data done");
+            if (argc > 0 && strcmp(argv[0], "rebuild") == 0) {
+                rc = doRebuild(&ctx);
+            } else if (argc > 0 && strcmp(argv[0], "check-rebuild") == 0) {
+                rc = checkRebuild(&ctx);
+            } else {
+                doRollup(&ctx);
+            }
+            lap ("Rollup done");
+        }
+        rollupCtxRelease (&ctx);
         sqlite3_close(db);
     }
     return rc;
-}   
+}
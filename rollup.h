@@ -0,0 +1,294 @@
+/*
+ * Data rollup with domino effect
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <time.h>
+#include "sqlite3.h"
+#ifdef ROLLUP_EXTENSION
+// built as a loadable extension, every call goes through the host API table
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+#endif
+#include "jobset.h"
+#include "dirtyrange.h"
+#include "metrics.h"
+#include "tdigest.h"
+#include "store.h"
+#include "level.h"
+#include "calendar.h"
+
+/*
+ * Query shapes used by the rollup engine. Each one is prepared once per
+ * connection the first time it is needed and then reset and rebound on
+ * every later use, so the hot path never goes through the SQL parser.
+ */
+typedef enum {
+    STMT_JOB_INSERT = 0,
+    STMT_JOB_SELECT,
+    STMT_JOB_DELETE,
+    STMT_HISTORY_INSERT,
+    STMT_HISTORY_SELECT,
+    STMT_ROLLUP_SELECT,
+    STMT_ROLLUP_INSERT,
+    STMT_ROLLUP_UPDATE,
+    STMT_ROLLUP_UPSERT,
+    STMT_TAG_SELECT,
+    STMT_HISTORY_SCAN,
+    STMT_ROLLUP_DELETE_TAG,
+    STMT_JOB_DELETE_TAG,
+    STMT_JOB_SELECT_SHARD,
+    STMT_HISTORY_INSERT_BULK,
+    STMT_ROLLUP_BUCKET,
+    STMT_BLOCK_FIND,
+    STMT_BLOCK_INSERT,
+    STMT_BLOCK_DELETE,
+    STMT_BLOCK_RANGE,
+    STMT_TAG_SELECT_BLOCK,
+    STMT_JOB_COUNT,
+    STMT_HISTORY_OLDEST,
+    STMT_BLOCK_OLDEST,
+    STMT_ROLLUP_OLDEST,
+    STMT_JOB_OLDEST,
+    STMT_HISTORY_PURGE,
+    STMT_BLOCK_PURGE,
+    STMT_ROLLUP_PURGE,
+    STMT_ROLLUP_TAGS,
+    STMT_RETENTION_SELECT,
+    STMT_JOB_OLDEST_TYPE,
+    STMT_DATA_VERSION,
+    STMT_MARK_SELECT,
+    STMT_MARK_OLDEST,
+    STMT_MARK_UPSERT,
+    STMT_MARK_SCAN,
+    STMT_HISTORY_AGG,
+    STMT_ROLLUP_AGG,
+    STMT_COUNT
+} enStatement;
+
+/*
+ * How a rollup bucket is written
+ */
+typedef enum {
+    UPSERT_TWO_STEP = 0,    // insert, update on constraint violation
+    UPSERT_NATIVE           // insert ... on conflict do update (SQLite >= 3.24)
+} enUpsertMode;
+
+/*
+ * Samples of one bucket gathered for foldValues
+ */
+typedef struct valueBuffer {
+    double *values;
+    int count;
+    int capacity;
+    int rc;                 // SQLITE_NOMEM once a push failed
+} valueBuffer;
+
+/*
+ * Connection context. Owns the database handle and the statement cache
+ */
+typedef struct rollupCtx {
+    sqlite3 *db;
+    rollupStore *store;     // where the engine reads and writes, SQLite by default
+    sqlite3_stmt *stmt[STMT_COUNT];
+    int64_t stmtPrepared;
+    int64_t stmtReused;
+    int upsertMode;
+    int batchJobs;          // jobs per transaction, 0 for autocommit
+    int batchMillis;        // max time a transaction stays open
+    int batchCount;
+    double batchStart;
+    int64_t jobs;
+    int64_t commits;
+    int threads;            // roll up workers, 1 runs on this connection only
+    int incremental;        // ingest merges samples into their hour, no hour jobs
+    int columnar;           // raw samples live in HistoryBlock, not History
+    int watermark;          // jobs only for late data, see watermark.c
+    jobSet dirty;           // jobs pending since the last flush
+    dirtyTracker ranges;    // hours ingested since the last flush, not yet queued
+    jobKey *pending;        // new jobs not yet written to the job table
+    int pendingCount;
+    int pendingCapacity;
+    int64_t jobRequests;
+    int64_t jobCoalesced;
+    int64_t jobRows;
+    int64_t jobsAhead;      // jobs left to a watermark pass
+    int64_t markBuckets;    // buckets rolled up by watermark passes
+    rollupMetrics metrics;
+    valueBuffer values;     // samples of the bucket being rolled up
+    struct blockCache *blockCache;  // last block decoded, see block.h
+} rollupCtx;
+
+/*
+ * The values stored in one roll up row
+ */
+typedef struct rollupBucket {
+    double vsum;
+    double vavg;
+    double vmax;
+    double vmin;
+    int64_t vcount;
+    double vm2;             // sum of squared deviations from the mean
+    tdigest sketch;         // quantiles, merged from the children
+} rollupBucket;
+
+/*
+ * One raw sample
+ */
+typedef struct rollupSample {
+    int64_t tagId;
+    int64_t ts;
+    double value;
+} rollupSample;
+
+#define INGEST_ROWS             64      // rows per bulk insert statement
+#define BATCH_JOBS_DEFAULT      1000
+#define BATCH_MILLIS_DEFAULT    1000
+#define JOB_FLUSH_SIZE          4096
+#define RETENTION_ROWS          5000    // rows purged per transaction, aimed at
+#define RETENTION_SPAN_MAX      4096    // parent buckets per purge transaction
+#define RETENTION_VACUUM_PAGES  256     // pages released after each purge
+#define ROLLUP_STATE_MAX        (48 + TDIGEST_BLOB_MAX)    // state blob of rollup_agg()
+#define ROLLUP_AGG_FOLD         65536   // samples rollup_agg() gathers before it folds them
+#define DAEMON_TICK_DEFAULT     10      // seconds
+#define DAEMON_SLICE_DEFAULT    1000    // jobs
+#define DAEMON_POLL_MILLIS      250     // how often the data version is read
+#define DAEMON_BUSY_MILLIS      5000
+
+void lap (const char *message);
+time_t iso8602ts (const char *isoDate);
+char *tt2iso8602 (time_t tt, char *dt);
+int execSql (sqlite3 *db, const char *sql);
+void rollupCtxInit (rollupCtx *ctx, sqlite3 *db);
+void rollupCtxRelease (rollupCtx *ctx);
+sqlite3_stmt *stmtGet (rollupCtx *ctx, int id);
+void stmtFinalize (rollupCtx *ctx);
+int stmtExec (rollupCtx *ctx, sqlite3_stmt *st);
+int jobFlush (rollupCtx *ctx);
+int rollupBacklog (rollupCtx *ctx);
+int batchBegin (rollupCtx *ctx);
+int batchEnd (rollupCtx *ctx, int rc);
+int batchStep (rollupCtx *ctx);
+int updateRollupControl (rollupCtx *ctx, int64_t tagId, int type, time_t utc);
+int writeRollup (rollupCtx *ctx, int64_t tagId, int type, time_t ts, const rollupBucket *b);
+void foldSample (rollupBucket *b, double value);
+void foldValues (rollupBucket *b, const double *values, int count);
+void valuePush (valueBuffer *v, double value);
+void foldBucket (rollupBucket *to, const rollupBucket *from);
+int mergeRollup (rollupCtx *ctx, int64_t tagId, int type, time_t ts, const rollupBucket *delta);
+int computeJob (rollupCtx *ctx, int64_t tagId, int type, time_t ts, time_t *start, rollupBucket *b);
+int applyJob (rollupCtx *ctx, int64_t id, int64_t tagId, int type, time_t start, const rollupBucket *b);
+int rollup (rollupCtx *ctx, int type);
+int rollupSlice (rollupCtx *ctx, int type, int maxJobs, int64_t *done);
+void resetDatabase (sqlite3 *db);
+int ensureSchema (sqlite3 *db);
+int settingsLoad (rollupCtx *ctx, const char *levels, int watermark);
+
+/*
+ * Aggregate of one tag over a time range, (from, to] like the buckets
+ */
+typedef struct rollupQuery {
+    int64_t tagId;
+    int64_t from;
+    int64_t to;
+    rollupBucket b;
+    int64_t bucketsRead;
+    int64_t samplesRead;
+} rollupQuery;
+
+/*
+ * What a retention pass did
+ */
+typedef struct retentionStats {
+    int tags;
+    int64_t deleted[ROLLUP_LEVELS + 1]; // rows per level, the raw samples first
+    int64_t chunks;         // purge transactions
+    int held;               // levels held back by pending jobs
+    int uncovered;          // levels stopped where the level above lacks rows
+    int unvacuumed;         // purged pages kept, the database has no incremental vacuum
+} retentionStats;
+
+/*
+ * Workload of the benchmark harness
+ */
+typedef struct benchConfig {
+    int tags;
+    int interval;           // seconds between two samples of a tag
+    const char *startDate;  // ISO 8601, UTC
+    const char *endDate;
+    double lateRatio;       // share of samples delivered after the first roll up
+    int repeats;
+} benchConfig;
+
+/*
+ * How the daemon runs
+ */
+typedef struct daemonConfig {
+    int tick;               // seconds between two wake ups when nothing changed
+    int slice;              // jobs per slice, 0 to drain a level in one go
+} daemonConfig;
+
+/* aggregate.c */
+int bucketSerialize (const rollupBucket *b, unsigned char *blob);
+int bucketDeserialize (rollupBucket *b, const void *blob, int bytes);
+int aggregateRegister (sqlite3 *db);
+
+/* bench.c */
+int benchRun (rollupCtx *ctx, const benchConfig *cfg);
+
+/* daemon.c */
+int daemonRun (rollupCtx *ctx, const daemonConfig *cfg);
+
+/* ingest.c */
+int ingestSamples (rollupCtx *ctx, const rollupSample *samples, int count);
+int ingestBench (rollupCtx *ctx, int64_t count, int tags);
+
+/* query.c */
+int queryRange (rollupCtx *ctx, rollupQuery *q);
+
+/* retention.c */
+int retentionRun (rollupCtx *ctx, int64_t now, retentionStats *stats);
+int retentionSet (rollupCtx *ctx, int64_t tagId, int type, int keepDays);
+int retentionVacuum (rollupCtx *ctx);
+int retentionHorizon (rollupCtx *ctx, int64_t tagId, int64_t now, int64_t *horizon);
+
+/* series.c */
+int seriesRegister (sqlite3 *db);
+
+/* watermark.c */
+int markBehind (rollupCtx *ctx, const jobKey *key, int *behind);
+int markAdvance (rollupCtx *ctx, int type);
+
+/* parallel.c */
+int rollupParallel (rollupCtx *ctx, int type);
+
+#endif
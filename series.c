@@ -0,0 +1,398 @@
+/*
+ * rollup_series, the roll ups of a tag at the resolution asked for
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+/*
+ * Columns of the table. The hidden ones are the arguments of
+ * rollup_series(tagid, start, end, resolution)
+ */
+enum {
+    SERIES_TS = 0,
+    SERIES_LEVEL,
+    SERIES_VSUM,
+    SERIES_VAVG,
+    SERIES_VMAX,
+    SERIES_VMIN,
+    SERIES_VCOUNT,
+    SERIES_VSTDDEV,
+    SERIES_SKETCH,
+    SERIES_TAGID,
+    SERIES_START,
+    SERIES_END,
+    SERIES_RESOLUTION
+};
+
+/*
+ * Constraints xBestIndex hands to xFilter, one bit each in idxNum. The
+ * arguments come in this order
+ */
+#define SERIES_HAS_TAGID        0x01
+#define SERIES_HAS_START        0x02
+#define SERIES_HAS_END          0x04
+#define SERIES_HAS_RESOLUTION   0x08
+#define SERIES_HAS_TS_LOW       0x10    // ts > or >=, idxStr tells which
+#define SERIES_HAS_TS_HIGH      0x20    // ts < or <=
+
+typedef struct seriesTable {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} seriesTable;
+
+typedef struct seriesCursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *st;       // the rows of the chosen level, stepped as asked
+    int eof;
+    int type;
+    int64_t tagId;
+    sqlite3_value *args[4]; // tagid, start, end and resolution as given
+} seriesCursor;
+
+static const char *seriesSql[2] = {
+    "select ts, vsum, vavg, vmax, vmin, vcount, vstddev, sketch, tagid from rollup"
+    " where tagid = ?1 and type = ?2 and ts >= ?3 and ts < ?4 order by ts;",
+    "select ts, vsum, vavg, vmax, vmin, vcount, vstddev, sketch, tagid from rollup"
+    " where type = ?2 and ts >= ?3 and ts < ?4 order by tagid, ts;"
+};
+
+static int seriesConnect (sqlite3 *db, void *aux, int argc, const char *const *argv,
+                          sqlite3_vtab **vtab, char **err) {
+    seriesTable *t;
+    int rc = sqlite3_declare_vtab(db,
+        "create table x(ts, level, vsum, vavg, vmax, vmin, vcount, vstddev, sketch,"
+        " tagid hidden, start hidden, end hidden, resolution hidden)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    t = sqlite3_malloc(sizeof (*t));
+    if (t == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(t, 0, sizeof (*t));
+    t->db = db;
+    *vtab = &t->base;
+    return SQLITE_OK;
+}
+
+static int seriesDisconnect (sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+/**
+ * \brief Pick the constraints to push down
+ *        Equality on the hidden columns, the function arguments, and
+ *        ranges on ts all narrow the index scan of the roll up table. A
+ *        scan without a tag reads every tag and costs accordingly
+ * @param vtab The table
+ * @param info The constraints in, the plan out
+ * @return 0 if all good
+ */
+static int seriesBestIndex (sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    int slot[6] = {-1, -1, -1, -1, -1, -1};
+    int mask = 0;
+    int argc = 0;
+    int i;
+    for (i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        int bit = -1;
+        if (!c->usable) {
+            continue;
+        }
+        if (c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn >= SERIES_TAGID) {
+            bit = c->iColumn - SERIES_TAGID;
+        } else if (c->iColumn == SERIES_TS &&
+                   (c->op == SQLITE_INDEX_CONSTRAINT_GT || c->op == SQLITE_INDEX_CONSTRAINT_GE)) {
+            bit = 4;
+        } else if (c->iColumn == SERIES_TS &&
+                   (c->op == SQLITE_INDEX_CONSTRAINT_LT || c->op == SQLITE_INDEX_CONSTRAINT_LE)) {
+            bit = 5;
+        }
+        if (bit >= 0 && slot[bit] < 0) {
+            slot[bit] = i;
+            mask |= 1 << bit;
+        }
+    }
+    for (i = 0; i < 6; i++) {
+        if (slot[i] >= 0) {
+            info->aConstraintUsage[slot[i]].argvIndex = ++argc;
+            // ts ranges are checked again by SQLite, a real bound may round
+            info->aConstraintUsage[slot[i]].omit = i < 4;
+        }
+    }
+    // which ts bounds include their end, for xFilter
+    info->idxStr = sqlite3_mprintf("%c%c",
+        slot[4] >= 0 && info->aConstraint[slot[4]].op == SQLITE_INDEX_CONSTRAINT_GE ? 'e' : 'x',
+        slot[5] >= 0 && info->aConstraint[slot[5]].op == SQLITE_INDEX_CONSTRAINT_LE ? 'e' : 'x');
+    if (info->idxStr == NULL) {
+        return SQLITE_NOMEM;
+    }
+    info->needToFreeIdxStr = 1;
+    info->idxNum = mask;
+    if (mask & SERIES_HAS_TAGID) {
+        info->estimatedCost = mask & (SERIES_HAS_START | SERIES_HAS_END | SERIES_HAS_TS_LOW | SERIES_HAS_TS_HIGH) ? 10 : 100;
+        info->estimatedRows = info->estimatedCost * 10;
+        // rows of one tag come by time stamp
+        if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == SERIES_TS && !info->aOrderBy[0].desc) {
+            info->orderByConsumed = 1;
+        }
+    } else {
+        info->estimatedCost = 1e6;
+        info->estimatedRows = 1e6;
+    }
+    return SQLITE_OK;
+}
+
+static int seriesOpen (sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    seriesCursor *c = sqlite3_malloc(sizeof (*c));
+    if (c == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(c, 0, sizeof (*c));
+    c->eof = 1;
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+static void seriesReset (seriesCursor *c) {
+    int i;
+    sqlite3_finalize(c->st);
+    c->st = NULL;
+    for (i = 0; i < 4; i++) {
+        sqlite3_value_free(c->args[i]);
+        c->args[i] = NULL;
+    }
+    c->eof = 1;
+}
+
+static int seriesClose (sqlite3_vtab_cursor *cursor) {
+    seriesReset((seriesCursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+/**
+ * \brief A time stamp argument, epoch seconds or ISO 8601 text in UTC
+ * @param v The argument
+ * @return The time stamp
+ */
+static int64_t seriesTime (sqlite3_value *v) {
+    if (sqlite3_value_type(v) == SQLITE_TEXT) {
+        return iso8602ts((const char *)sqlite3_value_text(v));
+    }
+    return sqlite3_value_int64(v);
+}
+
+/**
+ * \brief The level to read for a resolution
+ *        A level name picks that level. Seconds pick the coarsest level in
+ *        use whose buckets are not longer, the fewest rows that still
+ *        resolve what was asked, and the finest level when all are
+ *        longer. No resolution reads the finest level
+ * @param v The resolution, NULL if none
+ * @param type The level
+ * @return 0 if all good, SQLITE_ERROR for an unknown or unused level name
+ */
+static int seriesLevel (sqlite3_value *v, int *type) {
+    int i;
+    *type = levelAt(0);
+    if (v == NULL || sqlite3_value_type(v) == SQLITE_NULL) {
+        return SQLITE_OK;
+    }
+    if (sqlite3_value_type(v) == SQLITE_TEXT) {
+        // raw and the levels not in use have no row in the level table
+        if (levelByName((const char *)sqlite3_value_text(v), type) != SQLITE_OK || levelGet(*type) == NULL) {
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+    int64_t seconds = sqlite3_value_int64(v);
+    for (i = 1; i < levelCount() && levelGet(levelAt(i))->seconds <= seconds; i++) {
+        *type = levelAt(i);
+    }
+    return SQLITE_OK;
+}
+
+static int seriesNext (sqlite3_vtab_cursor *cursor) {
+    seriesCursor *c = (seriesCursor *)cursor;
+    int rc = sqlite3_step(c->st);
+    if (rc == SQLITE_ROW) {
+        return SQLITE_OK;
+    }
+    c->eof = 1;
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Start a scan
+ *        The level is chosen here, the rows are then stepped from the
+ *        roll up table one at a time, nothing is read ahead
+ * @param cursor The cursor
+ * @param idxNum The constraints pushed down, see SERIES_HAS_TAGID
+ * @param idxStr Whether each ts bound includes its end
+ * @param argc How many arguments
+ * @param argv One per bit of idxNum, in bit order
+ * @return 0 if all good
+ */
+static int seriesFilter (sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr,
+                         int argc, sqlite3_value **argv) {
+    seriesCursor *c = (seriesCursor *)cursor;
+    seriesTable *t = (seriesTable *)cursor->pVtab;
+    sqlite3_value *arg[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int i;
+    int n = 0;
+    int rc;
+    seriesReset(c);
+    for (i = 0; i < 6; i++) {
+        if (idxNum & (1 << i)) {
+            arg[i] = argv[n++];
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        if (arg[i] != NULL && (c->args[i] = sqlite3_value_dup(arg[i])) == NULL) {
+            return SQLITE_NOMEM;
+        }
+    }
+    if (arg[0] != NULL && sqlite3_value_type(arg[0]) == SQLITE_NULL) {
+        return SQLITE_OK;   // tagid = NULL matches nothing
+    }
+    if (seriesLevel(arg[3], &c->type) != SQLITE_OK) {
+        sqlite3_free(t->base.zErrMsg);
+        t->base.zErrMsg = sqlite3_mprintf("rollup_series: no level %s", sqlite3_value_text(arg[3]));
+        return SQLITE_ERROR;
+    }
+    // a NULL bound is no bound
+    if (arg[1] != NULL && sqlite3_value_type(arg[1]) != SQLITE_NULL) {
+        from = seriesTime(arg[1]);
+    }
+    if (arg[2] != NULL && sqlite3_value_type(arg[2]) != SQLITE_NULL) {
+        to = seriesTime(arg[2]);
+    }
+    if (arg[4] != NULL) {
+        int64_t low = sqlite3_value_int64(arg[4]);
+        if (idxStr[0] != 'e' && low < INT64_MAX) {
+            low++;
+        }
+        from = low > from ? low : from;
+    }
+    if (arg[5] != NULL) {
+        int64_t high = sqlite3_value_int64(arg[5]);
+        if (idxStr[1] == 'e' && high < INT64_MAX) {
+            high++;
+        }
+        to = high < to ? high : to;
+    }
+    rc = sqlite3_prepare_v2(t->db, seriesSql[arg[0] == NULL], -1, &c->st, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(t->base.zErrMsg);
+        t->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(t->db));
+        return rc;
+    }
+    if (arg[0] != NULL) {
+        sqlite3_bind_value(c->st, 1, arg[0]);
+    }
+    sqlite3_bind_int   (c->st, 2, c->type);
+    sqlite3_bind_int64 (c->st, 3, from);
+    sqlite3_bind_int64 (c->st, 4, to);
+    c->eof = 0;
+    return seriesNext(cursor);
+}
+
+static int seriesEof (sqlite3_vtab_cursor *cursor) {
+    return ((seriesCursor *)cursor)->eof;
+}
+
+static int seriesColumn (sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    seriesCursor *c = (seriesCursor *)cursor;
+    switch (column) {
+        case SERIES_LEVEL:
+            sqlite3_result_text(context, levelName(c->type), -1, SQLITE_STATIC);
+            break;
+        case SERIES_TAGID:
+            sqlite3_result_value(context, sqlite3_column_value(c->st, 8));
+            break;
+        case SERIES_START:
+        case SERIES_END:
+        case SERIES_RESOLUTION:
+            if (c->args[column - SERIES_TAGID] != NULL) {
+                sqlite3_result_value(context, c->args[column - SERIES_TAGID]);
+            }
+            break;
+        default:
+            // ts, then the roll up columns in table order
+            sqlite3_result_value(context, sqlite3_column_value(c->st, column == SERIES_TS ? 0 : column - 1));
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int seriesRowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    seriesCursor *c = (seriesCursor *)cursor;
+    *rowid = sqlite3_column_int64(c->st, 0);
+    return SQLITE_OK;
+}
+
+static sqlite3_module seriesModule = {
+    0,                  // iVersion
+    NULL,               // xCreate, NULL for a table-valued function only
+    seriesConnect,
+    seriesBestIndex,
+    seriesDisconnect,
+    NULL,               // xDestroy
+    seriesOpen,
+    seriesClose,
+    seriesFilter,
+    seriesNext,
+    seriesEof,
+    seriesColumn,
+    seriesRowid,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/**
+ * \brief Register rollup_series on a connection
+ *        select * from rollup_series(tagid, start, end, resolution) gives
+ *        the buckets starting in [start, end) of the level that fits the
+ *        resolution, in seconds or as a level name. Times are epoch
+ *        seconds or ISO 8601 in UTC, and every argument but tagid may be
+ *        left out. Without a tag every tag is read, in tag order
+ * @param db The database connection
+ * @return 0 if all good
+ */
+int seriesRegister (sqlite3 *db) {
+    return sqlite3_create_module(db, "rollup_series", &seriesModule, NULL);
+}
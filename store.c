@@ -0,0 +1,681 @@
+/*
+ * SQLite storage backend
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "sqlite3.h"
+#include "rollup.h"
+#include "store.h"
+#include "block.h"
+
+/*
+ * The tables of the rollup database, through the statement cache of the
+ * connection context
+ */
+typedef struct sqliteStore {
+    rollupStore base;
+    rollupCtx *ctx;
+    sqlite3_stmt *jobs;     // job cursor between xJobBegin and xJobEnd
+    int autoVacuum;         // PRAGMA auto_vacuum, -1 until read
+} sqliteStore;
+
+/**
+ * \brief Open a write transaction
+ *        Every batch reads then writes. Taking the write lock up front
+ *        lets the busy handler wait for it, where a deferred transaction
+ *        would fail its first write after another connection committed
+ * @param s The store
+ * @return 0 if all good
+ */
+static int sqliteBegin (rollupStore *s) {
+    return execSql(((sqliteStore *)s)->ctx->db, "begin immediate;");
+}
+
+static int sqliteCommit (rollupStore *s) {
+    return execSql(((sqliteStore *)s)->ctx->db, "commit;");
+}
+
+static int sqliteRollback (rollupStore *s) {
+    return execSql(((sqliteStore *)s)->ctx->db, "rollback;");
+}
+
+static int sqliteAutocommit (rollupStore *s) {
+    return sqlite3_get_autocommit(((sqliteStore *)s)->ctx->db);
+}
+
+/**
+ * \brief Insert samples as History rows, INGEST_ROWS at a time, or with
+ *        ctx->columnar into the block store
+ * @param s The store
+ * @param in The samples, in (tag, ts) order
+ * @param count How many samples
+ * @return 0 if all good
+ */
+static int sqliteInsertSamples (rollupStore *s, const rollupSample *in, int count) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc = SQLITE_OK;
+    int i, j;
+    if (ctx->columnar) {
+        // one run per tag
+        for (i = 0; i < count && rc == SQLITE_OK; i = j) {
+            j = i + 1;
+            while (j < count && in[j].tagId == in[i].tagId) {
+                j++;
+            }
+            rc = blockStore(ctx, in[i].tagId, &in[i], j - i);
+        }
+        return rc;
+    }
+    for (i = 0; i + INGEST_ROWS <= count && rc == SQLITE_OK; i += INGEST_ROWS) {
+        sqlite3_stmt *st = stmtGet(ctx, STMT_HISTORY_INSERT_BULK);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        for (j = 0; j < INGEST_ROWS; j++) {
+            sqlite3_bind_int64  (st, j * 3 + 1, in[i + j].tagId);
+            sqlite3_bind_int64  (st, j * 3 + 2, in[i + j].ts);
+            sqlite3_bind_double (st, j * 3 + 3, in[i + j].value);
+        }
+        rc = stmtExec(ctx, st);
+    }
+    for (; i < count && rc == SQLITE_OK; i++) {
+        sqlite3_stmt *st = stmtGet(ctx, STMT_HISTORY_INSERT);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64  (st, 1, in[i].tagId);
+        sqlite3_bind_double (st, 2, in[i].value);
+        sqlite3_bind_int64  (st, 3, in[i].ts);
+        rc = stmtExec(ctx, st);
+    }
+    return rc;
+}
+
+/**
+ * \brief Hand every raw sample of a tag in (from, to] to fn
+ * @param s The store
+ * @param tagId The tag ID
+ * @param from Samples after this time stamp
+ * @param to Samples up to this time stamp
+ * @param fn Called once per sample
+ * @param arg Passed to fn
+ * @return 0 if all good
+ */
+static int sqliteScanSamples (rollupStore *s, int64_t tagId, int64_t from, int64_t to, storeSampleFn fn, void *arg) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc;
+    int64_t ts;
+    double value;
+    if (ctx->columnar) {
+        blockIter it;
+        if ((rc = blockIterBegin(ctx, &it, tagId, from, to)) != SQLITE_OK) {
+            return rc;
+        }
+        while ((rc = blockIterNext(&it, &ts, &value)) == SQLITE_ROW) {
+            fn(arg, ts, value);
+        }
+        blockIterEnd(&it);
+    } else {
+        sqlite3_stmt *st = stmtGet(ctx, STMT_HISTORY_SELECT);
+        if (st == NULL) {
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64 (st, 1, tagId);
+        sqlite3_bind_int64 (st, 2, from);
+        sqlite3_bind_int64 (st, 3, to);
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+            // SQLite stores a NaN as NULL, either way a missing sample
+            fn(arg, sqlite3_column_int64(st, 0),
+               sqlite3_column_type(st, 1) == SQLITE_NULL ? NAN : sqlite3_column_double(st, 1));
+        }
+        sqlite3_reset(st);
+    }
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Read a stored bucket
+ *        Columns are sum, max, min, count, M2 and sketch in that order. A
+ *        bucket written before M2 or the sketch existed has a NaN M2 and an
+ *        empty sketch, which then carry to every bucket it is folded into
+ * @param st The statement positioned on a row
+ * @param b The bucket
+ */
+static void readBucket (sqlite3_stmt *st, rollupBucket *b) {
+    memset(b, 0, sizeof (*b));
+    b->vsum =   sqlite3_column_double (st, 0);
+    b->vmax =   sqlite3_column_double (st, 1);
+    b->vmin =   sqlite3_column_double (st, 2);
+    b->vcount = sqlite3_column_int64  (st, 3);
+    b->vm2 = sqlite3_column_type(st, 4) == SQLITE_NULL ? NAN : sqlite3_column_double(st, 4);
+    tdigestDeserialize(&b->sketch, sqlite3_column_blob(st, 5), sqlite3_column_bytes(st, 5));
+}
+
+/**
+ * \brief Hand every bucket of a tag and level in [from, to) to fn
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level. See enAggregationType
+ * @param from First bucket start
+ * @param to Buckets starting before this time stamp
+ * @param fn Called once per bucket
+ * @param arg Passed to fn
+ * @return 0 if all good
+ */
+static int sqliteScanBuckets (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, storeBucketFn fn, void *arg) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_ROLLUP_SELECT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    sqlite3_bind_int   (st, 2, type);
+    sqlite3_bind_int64 (st, 3, from);
+    sqlite3_bind_int64 (st, 4, to);
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        rollupBucket b;
+        readBucket(st, &b);
+        fn(arg, sqlite3_column_int64(st, 6), &b);
+    }
+    sqlite3_reset(st);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Fold a range of one level into a bucket
+ *        Rows go through one rollup_agg() or rollup_merge() in SQLite, so
+ *        the rows never come back one by one. Blocks are decoded here and
+ *        folded as the aggregate would
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples in (from, to]
+ * @param from First bucket start
+ * @param to Buckets starting before this time stamp
+ * @param b The bucket, zeroed by the caller
+ * @param rows How many rows were read
+ * @return 0 if all good
+ */
+static int sqliteAggregate (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, rollupBucket *b, int64_t *rows) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc;
+    sqlite3_stmt *st;
+    if (type == ROLLUP_RAW && ctx->columnar) {
+        valueBuffer *v = &ctx->values;
+        blockIter it;
+        int64_t ts;
+        double value;
+        v->count = 0;
+        v->rc = SQLITE_OK;
+        if ((rc = blockIterBegin(ctx, &it, tagId, from, to)) != SQLITE_OK) {
+            return rc;
+        }
+        while ((rc = blockIterNext(&it, &ts, &value)) == SQLITE_ROW) {
+            valuePush(v, value);
+        }
+        blockIterEnd(&it);
+        if (rc != SQLITE_DONE) {
+            return rc;
+        }
+        foldValues(b, v->values, v->count);
+        *rows = v->count;
+        return v->rc;
+    }
+    st = stmtGet(ctx, type == ROLLUP_RAW ? STMT_HISTORY_AGG : STMT_ROLLUP_AGG);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    if (type == ROLLUP_RAW) {
+        sqlite3_bind_int64 (st, 2, from);
+        sqlite3_bind_int64 (st, 3, to);
+    } else {
+        sqlite3_bind_int   (st, 2, type);
+        sqlite3_bind_int64 (st, 3, from);
+        sqlite3_bind_int64 (st, 4, to);
+    }
+    rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW) {
+        // NULL when nothing was folded, which leaves the bucket empty
+        if (sqlite3_column_type(st, 0) != SQLITE_NULL) {
+            bucketDeserialize(b, sqlite3_column_blob(st, 0), sqlite3_column_bytes(st, 0));
+        }
+        *rows = sqlite3_column_int64(st, 1);
+        rc = SQLITE_OK;
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+/**
+ * \brief Read one bucket
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level. See enAggregationType
+ * @param ts The bucket start
+ * @param b The bucket, all zero if there is none
+ * @return 0 if all good
+ */
+static int sqliteReadBucket (rollupStore *s, int64_t tagId, int type, int64_t ts, rollupBucket *b) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_ROLLUP_BUCKET);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    sqlite3_bind_int   (st, 2, type);
+    sqlite3_bind_int64 (st, 3, ts);
+    rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW) {
+        readBucket(st, b);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        memset(b, 0, sizeof (*b));
+        rc = SQLITE_OK;
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+/**
+ * \brief Write one bucket into the roll up table, native upsert when the
+ *        library has it, insert then update otherwise
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The aggregation type
+ * @param ts The bucket start, already aligned to the aggregation type
+ * @param b The bucket values
+ * @return 0 if all good
+ */
+static int sqliteWriteBucket (rollupStore *s, int64_t tagId, int type, int64_t ts, const rollupBucket *b) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int rc;
+    unsigned char sketch[TDIGEST_BLOB_MAX];
+    // a sketch short of some samples, from a child written before sketches, is not kept
+    int sketchBytes = b->sketch.weight == b->vcount ? tdigestSerialize(&b->sketch, sketch) : 0;
+    double vstddev = b->vcount > 1 ? sqrt(b->vm2 / (b->vcount - 1)) : 0;
+    int id = ctx->upsertMode == UPSERT_NATIVE ? STMT_ROLLUP_UPSERT : STMT_ROLLUP_INSERT;
+    do {
+        sqlite3_stmt *up = stmtGet(ctx, id);
+        if (up == NULL) {
+            if (id == STMT_ROLLUP_UPSERT) {
+                // the library does not understand upsert, stay on two steps
+                ctx->upsertMode = UPSERT_TWO_STEP;
+                id = STMT_ROLLUP_INSERT;
+                continue;
+            }
+            return SQLITE_ERROR;
+        }
+        sqlite3_bind_int64  (up, 1, tagId);
+        sqlite3_bind_int    (up, 2, type);
+        sqlite3_bind_double (up, 3, b->vsum);
+        sqlite3_bind_double (up, 4, b->vavg);
+        sqlite3_bind_double (up, 5, b->vmax);
+        sqlite3_bind_double (up, 6, b->vmin);
+        sqlite3_bind_int64  (up, 7, b->vcount);
+        sqlite3_bind_int64  (up, 8, ts);
+        if (sketchBytes > 0) {
+            sqlite3_bind_blob (up, 9, sketch, sketchBytes, SQLITE_STATIC);
+        }
+        sqlite3_bind_double (up, 10, b->vm2);      // NaN, unknown, is stored as NULL
+        sqlite3_bind_double (up, 11, vstddev);
+        rc = stmtExec(ctx, up);
+        if (rc == SQLITE_CONSTRAINT && id == STMT_ROLLUP_INSERT) {
+            ctx->metrics.constraintFallbacks++;
+            id = STMT_ROLLUP_UPDATE;
+            continue;
+        }
+        break;
+    } while (1);
+    return rc;
+}
+
+static int sqliteJobInsert (rollupStore *s, const jobKey *key) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_JOB_INSERT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, key->tagId);
+    sqlite3_bind_int   (st, 2, key->type);
+    sqlite3_bind_int64 (st, 3, key->ts);
+    return stmtExec(ctx, st);
+}
+
+/**
+ * \brief Open the cursor over the jobs of one level, in (tag, ts) order
+ * @param s The store
+ * @param type The level. See enAggregationType
+ * @return 0 if all good
+ */
+static int sqliteJobBegin (rollupStore *s, int type) {
+    sqliteStore *q = (sqliteStore *)s;
+    q->jobs = stmtGet(q->ctx, STMT_JOB_SELECT);
+    if (q->jobs == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int (q->jobs, 1, type);
+    return SQLITE_OK;
+}
+
+static int sqliteJobNext (rollupStore *s, storeJob *job) {
+    sqliteStore *q = (sqliteStore *)s;
+    int rc = sqlite3_step(q->jobs);
+    if (rc == SQLITE_ROW) {
+        job->id =    sqlite3_column_int64 (q->jobs, 0);
+        job->tagId = sqlite3_column_int64 (q->jobs, 1);
+        job->ts =    sqlite3_column_int64 (q->jobs, 2);
+    }
+    return rc;
+}
+
+static void sqliteJobEnd (rollupStore *s) {
+    sqliteStore *q = (sqliteStore *)s;
+    if (q->jobs != NULL) {
+        sqlite3_reset(q->jobs);
+        q->jobs = NULL;
+    }
+}
+
+static int sqliteJobDelete (rollupStore *s, int64_t id) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_JOB_DELETE);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, id);
+    return stmtExec(ctx, st);
+}
+
+static int sqliteJobCount (rollupStore *s, int type, int64_t *count) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_JOB_COUNT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int (st, 1, type);
+    int rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW) {
+        *count = sqlite3_column_int64(st, 0);
+        rc = SQLITE_OK;
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+/**
+ * \brief Step a min() query
+ * @param st The statement, bound
+ * @param ts The minimum
+ * @return 0 if all good, SQLITE_DONE if there were no rows
+ */
+static int sqliteMin (sqlite3_stmt *st, int64_t *ts) {
+    int rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW) {
+        if (sqlite3_column_type(st, 0) == SQLITE_NULL) {
+            rc = SQLITE_DONE;
+        } else {
+            *ts = sqlite3_column_int64(st, 0);
+            rc = SQLITE_OK;
+        }
+    }
+    sqlite3_reset(st);
+    return rc;
+}
+
+static int sqliteJobOldest (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    sqlite3_stmt *st = stmtGet(((sqliteStore *)s)->ctx, tagId != 0 ? STMT_JOB_OLDEST : STMT_JOB_OLDEST_TYPE);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    if (tagId != 0) {
+        sqlite3_bind_int64 (st, 1, tagId);
+        sqlite3_bind_int   (st, 2, type);
+    } else {
+        sqlite3_bind_int   (st, 1, type);
+    }
+    return sqliteMin(st, ts);
+}
+
+/**
+ * \brief First sample, or first bucket start, of a tag at a level
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param ts The time stamp
+ * @return 0 if all good, SQLITE_DONE if the level is empty
+ */
+static int sqliteOldest (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int id = type != ROLLUP_RAW ? STMT_ROLLUP_OLDEST : ctx->columnar ? STMT_BLOCK_OLDEST : STMT_HISTORY_OLDEST;
+    sqlite3_stmt *st = stmtGet(ctx, id);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    if (type != ROLLUP_RAW) {
+        sqlite3_bind_int (st, 2, type);
+    }
+    return sqliteMin(st, ts);
+}
+
+/**
+ * \brief Delete the buckets of a level that start before end, or the
+ *        samples up to end. Blocks go whole, so with ctx->columnar the
+ *        samples of a block that runs past end stay
+ * @param s The store
+ * @param tagId The tag ID
+ * @param type The level, ROLLUP_RAW for the samples
+ * @param end The first bucket start to keep
+ * @param deleted Rows deleted
+ * @return 0 if all good
+ */
+static int sqlitePurge (rollupStore *s, int64_t tagId, int type, int64_t end, int64_t *deleted) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    int id = type != ROLLUP_RAW ? STMT_ROLLUP_PURGE : ctx->columnar ? STMT_BLOCK_PURGE : STMT_HISTORY_PURGE;
+    sqlite3_stmt *st = stmtGet(ctx, id);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    if (type != ROLLUP_RAW) {
+        sqlite3_bind_int   (st, 2, type);
+        sqlite3_bind_int64 (st, 3, end);
+    } else {
+        sqlite3_bind_int64 (st, 2, end);
+    }
+    int rc = stmtExec(ctx, st);
+    *deleted = rc == SQLITE_OK ? sqlite3_changes(ctx->db) : 0;
+    return rc;
+}
+
+/**
+ * \brief Hand every tag with roll up rows to fn
+ * @param s The store
+ * @param fn Called once per tag, in tag order
+ * @param arg Passed to fn
+ * @return 0 if all good
+ */
+static int sqliteListTags (rollupStore *s, storeTagFn fn, void *arg) {
+    sqlite3_stmt *st = stmtGet(((sqliteStore *)s)->ctx, STMT_ROLLUP_TAGS);
+    int rc;
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        fn(arg, sqlite3_column_int64(st, 0));
+    }
+    sqlite3_reset(st);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * \brief Give free pages back to the file system, a few at a time
+ *        Only a database with auto_vacuum=INCREMENTAL can; any other one
+ *        keeps its free pages for later inserts, see retentionVacuum
+ * @param s The store
+ * @param pages The most pages to release
+ * @return 0 if all good, SQLITE_DONE if the database cannot release pages
+ */
+static int sqliteVacuum (rollupStore *s, int pages) {
+    sqliteStore *q = (sqliteStore *)s;
+    char sql[64];
+    if (q->autoVacuum < 0) {
+        sqlite3_stmt *st = NULL;
+        q->autoVacuum = 0;
+        if (sqlite3_prepare_v2(q->ctx->db, "PRAGMA auto_vacuum;", -1, &st, NULL) == SQLITE_OK &&
+            sqlite3_step(st) == SQLITE_ROW) {
+            q->autoVacuum = sqlite3_column_int(st, 0);
+        }
+        sqlite3_finalize(st);
+    }
+    if (q->autoVacuum != 2) {
+        return SQLITE_DONE;
+    }
+    sprintf (sql, "PRAGMA incremental_vacuum(%d);", pages);
+    return execSql(q->ctx->db, sql);
+}
+
+static int sqliteMarkGet (rollupStore *s, int64_t tagId, int type, int64_t *ts) {
+    sqlite3_stmt *st = stmtGet(((sqliteStore *)s)->ctx, tagId != 0 ? STMT_MARK_SELECT : STMT_MARK_OLDEST);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    if (tagId != 0) {
+        sqlite3_bind_int64 (st, 1, tagId);
+        sqlite3_bind_int   (st, 2, type);
+    } else {
+        sqlite3_bind_int   (st, 1, type);
+    }
+    return sqliteMin(st, ts);
+}
+
+static int sqliteMarkSet (rollupStore *s, int64_t tagId, int type, int64_t ts) {
+    rollupCtx *ctx = ((sqliteStore *)s)->ctx;
+    sqlite3_stmt *st = stmtGet(ctx, STMT_MARK_UPSERT);
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64 (st, 1, tagId);
+    sqlite3_bind_int   (st, 2, type);
+    sqlite3_bind_int64 (st, 3, ts);
+    return stmtExec(ctx, st);
+}
+
+static int sqliteMarkScan (rollupStore *s, int type, storeMarkFn fn, void *arg) {
+    sqlite3_stmt *st = stmtGet(((sqliteStore *)s)->ctx, STMT_MARK_SCAN);
+    int rc;
+    if (st == NULL) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int (st, 1, type);
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        fn(arg, sqlite3_column_int64(st, 0), sqlite3_column_int64(st, 1));
+    }
+    sqlite3_reset(st);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void sqliteReset (rollupStore *s) {
+    resetDatabase(((sqliteStore *)s)->ctx->db);
+}
+
+static void sqliteClose (rollupStore *s) {
+    sqliteJobEnd(s);
+    free(s);
+}
+
+static const storeMethods sqliteMethods = {
+    "sqlite",
+    sqliteBegin,
+    sqliteCommit,
+    sqliteRollback,
+    sqliteAutocommit,
+    sqliteInsertSamples,
+    sqliteScanSamples,
+    sqliteScanBuckets,
+    sqliteAggregate,
+    sqliteReadBucket,
+    sqliteWriteBucket,
+    sqliteJobInsert,
+    sqliteJobBegin,
+    sqliteJobNext,
+    sqliteJobEnd,
+    sqliteJobDelete,
+    sqliteJobCount,
+    sqliteJobOldest,
+    sqliteOldest,
+    sqlitePurge,
+    sqliteListTags,
+    sqliteVacuum,
+    sqliteMarkGet,
+    sqliteMarkSet,
+    sqliteMarkScan,
+    sqliteReset,
+    sqliteClose
+};
+
+/**
+ * \brief Open the SQLite backend on the database of a context
+ *        Statements come from the context cache, so the store must be
+ *        closed before the context is released
+ * @param ctx The connection context
+ * @return The store or NULL if out of memory
+ */
+rollupStore *storeOpenSqlite (rollupCtx *ctx) {
+    sqliteStore *q = calloc(1, sizeof (sqliteStore));
+    if (q != NULL) {
+        q->base.methods = &sqliteMethods;
+        q->ctx = ctx;
+        q->autoVacuum = -1;
+    }
+    return (rollupStore *)q;
+}
+
+/**
+ * \brief Open a backend by name
+ * @param ctx The connection context
+ * @param name "sqlite" or "memory"
+ * @return The store or NULL if the name is unknown or out of memory
+ */
+rollupStore *storeOpen (rollupCtx *ctx, const char *name) {
+    if (strcmp(name, "sqlite") == 0) {
+        return storeOpenSqlite(ctx);
+    }
+    if (strcmp(name, "memory") == 0) {
+        return storeOpenMemory(ctx);
+    }
+    return NULL;
+}
@@ -0,0 +1,107 @@
+/*
+ * Storage backends of the roll up engine
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include "sqlite3.h"
+#include "jobset.h"
+
+struct rollupCtx;
+struct rollupBucket;
+struct rollupSample;
+
+/*
+ * A job read back from a store
+ */
+typedef struct storeJob {
+    int64_t id;
+    int64_t tagId;
+    int64_t ts;
+} storeJob;
+
+typedef struct rollupStore rollupStore;
+
+typedef void (*storeSampleFn) (void *arg, int64_t ts, double value);
+typedef void (*storeBucketFn) (void *arg, int64_t ts, const struct rollupBucket *b);
+typedef void (*storeTagFn) (void *arg, int64_t tagId);
+typedef void (*storeMarkFn) (void *arg, int64_t tagId, int64_t ts);
+
+/*
+ * What the roll up engine needs from where the data lives. Every method
+ * returns a SQLite result code, whatever the backend. Ranges of raw samples
+ * are (from, to], as an hour holds (start, start + 3600], and ranges of
+ * buckets are [from, to). Where a method takes a level, ROLLUP_RAW stands
+ * for the samples, and xPurge of the samples up to end drops the ones
+ * whose hours start before end
+ */
+typedef struct storeMethods {
+    const char *name;
+    int (*xBegin) (rollupStore *s);
+    int (*xCommit) (rollupStore *s);
+    int (*xRollback) (rollupStore *s);
+    int (*xAutocommit) (rollupStore *s);    // non zero outside a transaction
+    int (*xInsertSamples) (rollupStore *s, const struct rollupSample *samples, int count);   // in (tag, ts) order
+    int (*xScanSamples) (rollupStore *s, int64_t tagId, int64_t from, int64_t to, storeSampleFn fn, void *arg);
+    int (*xScanBuckets) (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, storeBucketFn fn, void *arg);
+    int (*xAggregate) (rollupStore *s, int64_t tagId, int type, int64_t from, int64_t to, struct rollupBucket *b, int64_t *rows);
+    int (*xReadBucket) (rollupStore *s, int64_t tagId, int type, int64_t ts, struct rollupBucket *b);
+    int (*xWriteBucket) (rollupStore *s, int64_t tagId, int type, int64_t ts, const struct rollupBucket *b);
+    int (*xJobInsert) (rollupStore *s, const jobKey *key);     // SQLITE_CONSTRAINT if already queued
+    int (*xJobBegin) (rollupStore *s, int type);
+    int (*xJobNext) (rollupStore *s, storeJob *job);          // SQLITE_ROW or SQLITE_DONE
+    void (*xJobEnd) (rollupStore *s);
+    int (*xJobDelete) (rollupStore *s, int64_t id);
+    int (*xJobCount) (rollupStore *s, int type, int64_t *count);
+    int (*xJobOldest) (rollupStore *s, int64_t tagId, int type, int64_t *ts);   // tag 0 for all, SQLITE_DONE if none
+    int (*xOldest) (rollupStore *s, int64_t tagId, int type, int64_t *ts);      // SQLITE_DONE if empty
+    int (*xPurge) (rollupStore *s, int64_t tagId, int type, int64_t end, int64_t *deleted);
+    int (*xListTags) (rollupStore *s, storeTagFn fn, void *arg);
+    int (*xVacuum) (rollupStore *s, int pages);                                // SQLITE_DONE if it cannot
+    int (*xMarkGet) (rollupStore *s, int64_t tagId, int type, int64_t *ts);    // tag 0 for the lowest, SQLITE_DONE if none
+    int (*xMarkSet) (rollupStore *s, int64_t tagId, int type, int64_t ts);
+    int (*xMarkScan) (rollupStore *s, int type, storeMarkFn fn, void *arg);    // in tag order
+    void (*xReset) (rollupStore *s);
+    void (*xClose) (rollupStore *s);
+} storeMethods;
+
+/*
+ * Base of every backend, which puts it first in its own struct
+ */
+struct rollupStore {
+    const storeMethods *methods;
+};
+
+rollupStore *storeOpen (struct rollupCtx *ctx, const char *name);
+rollupStore *storeOpenSqlite (struct rollupCtx *ctx);
+rollupStore *storeOpenMemory (struct rollupCtx *ctx);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Mergeable quantile sketch (t-digest)
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tdigest.h"
+
+#define TDIGEST_VERSION 1
+
+/*
+ * Serialized form, native byte order: the header then count centroids
+ */
+typedef struct tdHeader {
+    uint32_t version;
+    uint32_t count;
+    double min;
+    double max;
+} tdHeader;
+
+static int centroidCompare (const void *a, const void *b) {
+    const tdCentroid *x = a;
+    const tdCentroid *y = b;
+    return x->mean < y->mean ? -1 : x->mean > y->mean;
+}
+
+/**
+ * \brief The largest quantile a centroid starting at q may reach, one unit
+ *        of the k1 scale function k(q) = compression / (2 pi) * asin(2q - 1)
+ *        further. With a = asin(2q - 1) and b = 2 pi / compression the limit
+ *        is (1 + sin(a + b)) / 2, expanded so only a square root is left
+ * @param q The quantile where the centroid starts, 0 to 1
+ * @return The quantile limit
+ */
+static double scaleLimit (double q) {
+    const double cosB = cos(2 * M_PI / TDIGEST_COMPRESSION);    // folded by the compiler
+    const double sinB = sin(2 * M_PI / TDIGEST_COMPRESSION);
+    double sinA = 2 * q - 1;
+    if (sinA >= cosB) {
+        return 1;           // a + b passes pi / 2, the rest fits in one centroid
+    }
+    double cosA = 2 * sqrt(q * (1 - q));
+    return (1 + sinA * cosB + cosA * sinB) / 2;
+}
+
+/**
+ * \brief Append one centroid, compressing first when the digest is full
+ * @param d The digest
+ * @param mean The centroid mean
+ * @param weight The centroid weight
+ */
+static void tdigestPush (tdigest *d, double mean, double weight) {
+    if (d->count == TDIGEST_CAPACITY) {
+        tdigestCompress(d);
+    }
+    if (d->weight == 0 || mean < d->min) {
+        d->min = mean;
+    }
+    if (d->weight == 0 || mean > d->max) {
+        d->max = mean;
+    }
+    d->c[d->count].mean = mean;
+    d->c[d->count].weight = weight;
+    d->count++;
+    d->weight += weight;
+    d->sorted = 0;
+}
+
+/**
+ * \brief Add a sample
+ * @param d The digest
+ * @param value The sample
+ * @param weight How many times it was seen, usually 1
+ */
+void tdigestAdd (tdigest *d, double value, double weight) {
+    tdigestPush(d, value, weight);
+}
+
+/**
+ * \brief Fold neighbours of a sorted centroid run together as long as the
+ *        merged centroid spans at most one unit of the scale function
+ * @param in The centroids in mean order
+ * @param count How many centroids
+ * @param weight Their total weight
+ * @param out Where the result goes, may be in
+ * @return How many centroids are left
+ */
+static int compressRun (const tdCentroid *in, int count, double weight, tdCentroid *out) {
+    int i, n = 0;
+    double before = 0;
+    double limit = scaleLimit(0) * weight;
+    tdCentroid cur = in[0];
+    for (i = 1; i < count; i++) {
+        double w = cur.weight + in[i].weight;
+        if (before + w <= limit) {
+            cur.mean += (in[i].mean - cur.mean) * in[i].weight / w;
+            cur.weight = w;
+        } else {
+            out[n++] = cur;
+            before += cur.weight;
+            limit = scaleLimit(before / weight) * weight;
+            cur = in[i];
+        }
+    }
+    out[n++] = cur;
+    return n;
+}
+
+/**
+ * \brief Merge a digest into another one
+ *        Two compressed digests are merged in one linear pass, so a parent
+ *        bucket costs a pass per child rather than a sort
+ * @param to The digest to merge into
+ * @param from The digest to merge
+ */
+void tdigestMerge (tdigest *to, const tdigest *from) {
+    tdCentroid run[2 * TDIGEST_CAPACITY];
+    int i = 0, j = 0, n = 0;
+    if (from->weight == 0) {
+        return;
+    }
+    double min = to->weight == 0 || from->min < to->min ? from->min : to->min;
+    double max = to->weight == 0 || from->max > to->max ? from->max : to->max;
+    if (!from->sorted) {
+        for (i = 0; i < from->count; i++) {
+            tdigestPush(to, from->c[i].mean, from->c[i].weight);
+        }
+    } else {
+        tdigestCompress(to);
+        while (i < to->count || j < from->count) {
+            if (j == from->count || (i < to->count && to->c[i].mean <= from->c[j].mean)) {
+                run[n++] = to->c[i++];
+            } else {
+                run[n++] = from->c[j++];
+            }
+        }
+        to->weight += from->weight;
+        to->count = compressRun(run, n, to->weight, to->c);
+        to->sorted = 1;
+    }
+    to->min = min;
+    to->max = max;
+}
+
+/**
+ * \brief Sort the centroids and compress them
+ * @param d The digest
+ */
+void tdigestCompress (tdigest *d) {
+    if (d->sorted || d->count == 0) {
+        d->sorted = 1;
+        return;
+    }
+    qsort(d->c, d->count, sizeof (tdCentroid), centroidCompare);
+    d->count = compressRun(d->c, d->count, d->weight, d->c);
+    d->sorted = 1;
+}
+
+/**
+ * \brief Estimate a quantile, interpolating between the centroid centers
+ *        and the exact min and max at the ends
+ * @param d The digest, compressed if needed
+ * @param q The quantile, 0 to 1
+ * @return The estimate, NAN if the digest is empty
+ */
+double tdigestQuantile (tdigest *d, double q) {
+    int i;
+    if (d->count == 0) {
+        return NAN;
+    }
+    tdigestCompress(d);
+    if (q <= 0) {
+        return d->min;
+    }
+    if (q >= 1) {
+        return d->max;
+    }
+    if (d->count == 1) {
+        return d->c[0].mean;
+    }
+    double index = q * d->weight;
+    double half = d->c[0].weight / 2;
+    if (index < half) {
+        return d->min + (d->c[0].mean - d->min) * index / half;
+    }
+    double left = half;
+    for (i = 0; i < d->count - 1; i++) {
+        double right = left + (d->c[i].weight + d->c[i + 1].weight) / 2;
+        if (index < right) {
+            return d->c[i].mean + (d->c[i + 1].mean - d->c[i].mean) * (index - left) / (right - left);
+        }
+        left = right;
+    }
+    half = d->c[d->count - 1].weight / 2;
+    return d->c[d->count - 1].mean + (d->max - d->c[d->count - 1].mean) * (index - left) / half;
+}
+
+/**
+ * \brief Write the compressed digest into a blob
+ * @param d The digest
+ * @param blob At least TDIGEST_BLOB_MAX bytes
+ * @return The blob size in bytes
+ */
+int tdigestSerialize (const tdigest *d, unsigned char *blob) {
+    tdigest copy;
+    tdHeader h;
+    if (!d->sorted) {
+        memcpy(&copy, d, sizeof (copy));
+        tdigestCompress(&copy);
+        d = &copy;
+    }
+    h.version = TDIGEST_VERSION;
+    h.count = d->count;
+    h.min = d->min;
+    h.max = d->max;
+    memcpy(blob, &h, sizeof (h));
+    memcpy(blob + sizeof (h), d->c, d->count * sizeof (tdCentroid));
+    return sizeof (h) + d->count * sizeof (tdCentroid);
+}
+
+/**
+ * \brief Read a digest written by tdigestSerialize
+ * @param d The digest
+ * @param blob The blob
+ * @param bytes The blob size
+ * @return 0 if all good, -1 if the blob is not a digest
+ */
+int tdigestDeserialize (tdigest *d, const void *blob, int bytes) {
+    tdHeader h;
+    int i;
+    memset(d, 0, sizeof (*d));
+    if (blob == NULL || bytes < (int)sizeof (h)) {
+        return -1;
+    }
+    memcpy(&h, blob, sizeof (h));
+    if (h.version != TDIGEST_VERSION || h.count > TDIGEST_CAPACITY ||
+        bytes != (int)(sizeof (h) + h.count * sizeof (tdCentroid))) {
+        return -1;
+    }
+    memcpy(d->c, (const unsigned char *)blob + sizeof (h), h.count * sizeof (tdCentroid));
+    d->count = h.count;
+    d->min = h.min;
+    d->max = h.max;
+    d->sorted = 1;
+    for (i = 0; i < d->count; i++) {
+        d->weight += d->c[i].weight;
+    }
+    return 0;
+}
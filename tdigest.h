@@ -0,0 +1,68 @@
+/*
+ * Mergeable quantile sketch (t-digest)
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TDIGEST_H
+#define TDIGEST_H
+
+#include <stdint.h>
+
+/*
+ * Merging t-digest with the k1 (arcsine) scale function. Once compressed it
+ * keeps at most about TDIGEST_COMPRESSION centroids, small ones near the
+ * tails so the extreme quantiles stay accurate. A zeroed struct is empty.
+ * Two digests merge by pooling their centroids, so a bucket is the merge of
+ * its children and never needs the raw samples again.
+ */
+#define TDIGEST_COMPRESSION 100
+#define TDIGEST_CAPACITY    (2 * TDIGEST_COMPRESSION)
+#define TDIGEST_BLOB_MAX    (24 + TDIGEST_CAPACITY * 16)
+
+typedef struct tdCentroid {
+    double mean;
+    double weight;
+} tdCentroid;
+
+typedef struct tdigest {
+    int count;
+    int sorted;             // centroids are compressed and in mean order
+    double weight;
+    double min;
+    double max;
+    tdCentroid c[TDIGEST_CAPACITY];
+} tdigest;
+
+void tdigestAdd (tdigest *d, double value, double weight);
+void tdigestMerge (tdigest *to, const tdigest *from);
+void tdigestCompress (tdigest *d);
+double tdigestQuantile (tdigest *d, double q);
+int tdigestSerialize (const tdigest *d, unsigned char *blob);
+int tdigestDeserialize (tdigest *d, const void *blob, int bytes);
+
+#endif
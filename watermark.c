@@ -0,0 +1,265 @@
+/*
+ * Watermark roll up
+ *
+ * Copyright (c) 2013, Carlos Tangerino <carlos.tangerino@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Disque nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "sqlite3.h"
+#include "rollup.h"
+
+/*
+ * A watermark per tag and level says the level is rolled up through the
+ * bucket before it: every bucket that starts before the watermark is
+ * complete and written. A pass moves the watermark over the buckets that
+ * got complete since, reading the level below, or the samples, once and in
+ * time order. Only data that lands behind a watermark needs a job, so on
+ * append mostly tags the job table stays close to empty.
+ *
+ * A bucket of the finest level is complete once the clock is past its end,
+ * a bucket of a level above once the level below is rolled up past its
+ * end. A tag gets the watermark of a level from the first job flushed for
+ * it at that level, right at the bucket of that job.
+ *
+ * Every process writing to the database must run in this mode: a job left
+ * to the watermark is lost to one that only looks at the job table.
+ */
+
+/*
+ * The watermarks of one level, in tag order
+ */
+typedef struct markList {
+    struct {
+        int64_t tagId;
+        int64_t ts;
+    } *marks;
+    int count;
+    int capacity;
+    int rc;
+} markList;
+
+/*
+ * The bucket being folded by a pass
+ */
+typedef struct markFold {
+    rollupCtx *ctx;
+    int64_t tagId;
+    int type;
+    int open;
+    int64_t start;
+    int64_t next;
+    rollupBucket b;
+    valueBuffer *values;    // samples of the open bucket, NULL above the finest level
+    int64_t rows;
+    int rc;
+} markFold;
+
+static void markCollect (void *arg, int64_t tagId, int64_t ts) {
+    markList *list = arg;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        void *marks = realloc(list->marks, capacity * sizeof (list->marks[0]));
+        if (marks == NULL) {
+            list->rc = SQLITE_NOMEM;
+            return;
+        }
+        list->marks = marks;
+        list->capacity = capacity;
+    }
+    list->marks[list->count].tagId = tagId;
+    list->marks[list->count].ts = ts;
+    list->count++;
+}
+
+/**
+ * \brief Write the open bucket, if it got anything
+ * @param f The fold
+ */
+static void markClose (markFold *f) {
+    if (f->values != NULL) {
+        foldValues(&f->b, f->values->values, f->values->count);
+        f->values->count = 0;
+        if (f->rc == SQLITE_OK) {
+            f->rc = f->values->rc;
+        }
+    }
+    if (f->open && f->b.vcount > 0 && f->rc == SQLITE_OK) {
+        f->b.vavg = f->b.vsum / f->b.vcount;
+        f->rc = writeRollup(f->ctx, f->tagId, f->type, f->start, &f->b);
+        f->ctx->markBuckets++;
+    }
+    f->open = 0;
+}
+
+/**
+ * \brief Make the bucket holding t the open one
+ * @param f The fold
+ * @param t A child bucket start, or a sample time stamp minus one
+ */
+static void markOpen (markFold *f, int64_t t) {
+    if (f->open && t >= f->start && t < f->next) {
+        return;
+    }
+    markClose(f);
+    f->start = bucketStart(f->type, t);
+    f->next = bucketNext(f->type, f->start);
+    memset(&f->b, 0, sizeof (f->b));
+    f->open = 1;
+}
+
+static void markSample (void *arg, int64_t ts, double value) {
+    markFold *f = arg;
+    markOpen(f, ts - 1);    // a bucket holds (start, next]
+    valuePush(f->values, value);
+    f->rows++;
+}
+
+static void markChild (void *arg, int64_t ts, const rollupBucket *child) {
+    markFold *f = arg;
+    markOpen(f, ts);
+    foldBucket(&f->b, child);
+    f->rows++;
+}
+
+/**
+ * \brief Tell whether a job is behind the watermark of its level
+ *        A tag with no watermark at that level gets one at the job's
+ *        bucket, so the job is left to the next pass
+ * @param ctx The connection context
+ * @param key The job
+ * @param behind Non zero if the job is needed
+ * @return 0 if all good
+ */
+int markBehind (rollupCtx *ctx, const jobKey *key, int *behind) {
+    rollupStore *s = ctx->store;
+    int64_t mark;
+    int rc = s->methods->xMarkGet(s, key->tagId, key->type, &mark);
+    *behind = 0;
+    if (rc == SQLITE_DONE) {
+        return s->methods->xMarkSet(s, key->tagId, key->type, key->ts);
+    }
+    if (rc == SQLITE_OK) {
+        *behind = key->ts < mark;
+    }
+    return rc;
+}
+
+/**
+ * \brief Move the watermarks of one level over its complete buckets
+ *        Each tag is read from its watermark to the end of its last
+ *        complete bucket in one scan and counts as one job in the batch.
+ *        The buckets are written before the watermark moves, so an
+ *        interrupted pass at worst writes some of them again
+ * @param ctx The connection context
+ * @param type The level. See enAggregationType
+ * @return 0 if all good
+ */
+int markAdvance (rollupCtx *ctx, int type) {
+    const rollupLevel *level = levelGet(type);
+    rollupStore *s = ctx->store;
+    markList marks = {NULL, 0, 0, SQLITE_OK};
+    markList below = {NULL, 0, 0, SQLITE_OK};
+    int rc = SQLITE_OK;
+    int i, j = 0;
+    if (level == NULL) {
+        return SQLITE_MISUSE;
+    }
+    // with ctx->incremental the ingest keeps the finest level complete
+    if (ctx->incremental && type == levelAt(0)) {
+        return SQLITE_OK;
+    }
+    int child = level->child;
+    int clock = child == ROLLUP_RAW || (ctx->incremental && child == levelAt(0));
+    int64_t now = bucketStart(type, time(NULL) - 1);
+    rc = s->methods->xMarkScan(s, type, markCollect, &marks);
+    if (rc == SQLITE_OK) {
+        rc = marks.rc;
+    }
+    if (rc == SQLITE_OK && !clock) {
+        rc = s->methods->xMarkScan(s, child, markCollect, &below);
+        if (rc == SQLITE_OK) {
+            rc = below.rc;
+        }
+    }
+    int batched = rc == SQLITE_OK && marks.count > 0 && ctx->batchJobs > 0 && s->methods->xAutocommit(s);
+    if (batched && (rc = batchBegin(ctx)) != SQLITE_OK) {
+        batched = 0;
+    }
+    for (i = 0; i < marks.count && rc == SQLITE_OK; i++) {
+        int64_t tagId = marks.marks[i].tagId;
+        int64_t limit = now;
+        if (!clock) {
+            while (j < below.count && below.marks[j].tagId < tagId) {
+                j++;
+            }
+            if (j == below.count || below.marks[j].tagId != tagId) {
+                continue;
+            }
+            limit = bucketStart(type, below.marks[j].ts);
+        }
+        if (marks.marks[i].ts >= limit) {
+            continue;
+        }
+        markFold f;
+        memset(&f, 0, sizeof (f));
+        f.ctx = ctx;
+        f.tagId = tagId;
+        f.type = type;
+        f.rc = SQLITE_OK;
+        if (child == ROLLUP_RAW) {
+            f.values = &ctx->values;
+            f.values->count = 0;
+            f.values->rc = SQLITE_OK;
+        }
+        int64_t t = monotonicNanos();
+        rc = child == ROLLUP_RAW ?
+            s->methods->xScanSamples(s, tagId, marks.marks[i].ts, limit, markSample, &f) :
+            s->methods->xScanBuckets(s, tagId, child, marks.marks[i].ts, limit, markChild, &f);
+        markClose(&f);
+        metricsRecord(&ctx->metrics, METRIC_READ, monotonicNanos() - t);
+        ctx->metrics.rowsRead[type] += f.rows;
+        if (rc == SQLITE_OK) {
+            rc = f.rc;
+        }
+        if (rc == SQLITE_OK) {
+            rc = s->methods->xMarkSet(s, tagId, type, limit);
+        }
+        if (rc == SQLITE_OK && batched && (rc = batchStep(ctx)) != SQLITE_OK) {
+            batched = 0;
+        }
+    }
+    if (batched) {
+        rc = batchEnd(ctx, rc);
+    }
+    free(marks.marks);
+    free(below.marks);
+    return rc;
+}